@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -23,69 +23,332 @@
 #include "fs.h"
 #include "buf.h"
 
+#define NBUCKET  251
+#define HASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+#define NODEV    ((uint)-1)   // dev of a buffer that holds no block
+#define BRESERVE 1024         // stop growing with fewer free pages than this
+
+// The cache starts with NBUF buffers and grows, one buffer per
+// miss, up to NBUFMAX while memory is plentiful; kalloc() calls
+// bshrink() to take it back down towards NBUF when memory runs
+// out. Buffers come from a slab cache.
+//
+// Buffers are spread over NBUCKET hash chains by (dev, blockno),
+// each with its own lock, so lookups of different blocks rarely
+// contend. A buffer's refcnt, lastuse and chain membership are
+// protected by the lock of the bucket it is in (b->bucket).
+// Every buffer also has a slot in bcache.buf[], which is what
+// evict() scans; a slot is cleared under the bucket lock of the
+// buffer that held it.
+struct bucket {
+  struct spinlock lock;
+  struct buf *head;  // hash chain through next
+  int nhit;          // lookups that found the block
+  int nmiss;         // lookups that had to recycle a buffer
+};
+
 struct {
+  struct kmem_cache *cache;
+  struct buf *buf[NBUFMAX];
+  int nbuf;          // buffers allocated
+  struct bucket bucket[NBUCKET];
+
+  // processes wait for an unreferenced buffer here.
   struct spinlock lock;
-  struct buf buf[NBUF];
+  int nwaiting;
+  int gen;           // bumped whenever a waiter could proceed
+
+  // evict()'s unlocked scan and bshrink() exclude each other,
+  // so that the scan never looks at a freed buffer.
+  int nscan;         // scans in progress, each with interrupts off
+  int shrinking;     // bshrink() is freeing buffers
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  // statistics, updated atomically.
+  int nretry;        // evictions that lost a race and rescanned
+  int ngrow;         // buffers added
+  int nshrink;       // buffers freed by bshrink()
+  int nwait;         // times bget() had to wait
+  int nreadahead;    // asynchronous reads started by breadahead()
 } bcache;
 
+static void
+bucket_insert(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head;
+  bk->head = b;
+  b->bucket = bk - bcache.bucket;
+}
+
+static void
+bucket_remove(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bk->head; *pp != b; pp = &(*pp)->next)
+    if(*pp == 0)
+      panic("bucket_remove");
+  *pp = b->next;
+}
+
+// Allocate a new empty buffer and give it a free slot.
+// Returns it with refcnt 1 and no bucket, or 0 if the
+// cache is at NBUFMAX or out of memory.
+static struct buf*
+grow(void)
+{
+  struct buf *b;
+  int i;
+
+  if(__sync_fetch_and_add(&bcache.nbuf, 1) >= NBUFMAX)
+    goto fail;
+  if((b = kmem_cache_alloc(bcache.cache)) == 0)
+    goto fail;
+  memset(b, 0, sizeof(*b));
+  initsleeplock(&b->lock, "buffer");
+  b->dev = NODEV;
+  b->refcnt = 1;
+  for(i = 0; ; i = (i + 1) % NBUFMAX){
+    if(bcache.buf[i] == 0 && __sync_bool_compare_and_swap(&bcache.buf[i], 0, b))
+      break;
+  }
+  b->slot = i;
+  __sync_fetch_and_add(&bcache.ngrow, 1);
+  return b;
+
+fail:
+  __sync_fetch_and_sub(&bcache.nbuf, 1);
+  return 0;
+}
+
 void
 binit(void)
 {
+  struct bucket *bk;
   struct buf *b;
 
+  bcache.cache = kmem_cache_create("buf", sizeof(struct buf));
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
+  // the cache never shrinks below these NBUF buffers.
+  for(int i = 0; i < NBUF; i++){
+    if((b = grow()) == 0)
+      panic("binit");
+    b->refcnt = 0;
+    bucket_insert(&bcache.bucket[i % NBUCKET], b);
+  }
+}
+
+// Look for block on device dev in bucket bk, whose lock
+// must be held. If found, take a reference to it.
+static struct buf*
+bucket_lookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      return b;
+    }
+  }
+  return 0;
+}
+
+// Start an unlocked scan of bcache.buf[]: no buffer is freed
+// until scan_end(). Waits while bshrink() runs. Interrupts stay
+// off until scan_end(), so bshrink() waits for a short time.
+static void
+scan_begin(void)
+{
+  for(;;){
+    push_off();
+    __sync_fetch_and_add(&bcache.nscan, 1);
+    if(__sync_fetch_and_add(&bcache.shrinking, 0) == 0)
+      return;
+    __sync_fetch_and_sub(&bcache.nscan, 1);
+    pop_off();
+    while(__sync_fetch_and_add(&bcache.shrinking, 0))
+      ;
+  }
+}
+
+static void
+scan_end(void)
+{
+  __sync_fetch_and_sub(&bcache.nscan, 1);
+  pop_off();
+}
+
+// Find the least recently used unreferenced buffer, unlink it
+// from its bucket, and return it with refcnt 1 and no bucket.
+// Returns 0 if every buffer is in use.
+//
+// The scan reads slots, refcnt and lastuse without locks, as a
+// hint; scan_begin() keeps the buffers it sees from being freed.
+// The choice is confirmed under the victim's bucket lock, and the
+// scan is repeated if another CPU got there first.
+static struct buf*
+evict(void)
+{
+  struct buf *b, *victim;
+  struct bucket *bk;
+  uint i;
+
+  for(;;){
+    scan_begin();
+    victim = 0;
+    for(i = 0; i < NBUFMAX; i++){
+      b = bcache.buf[i];
+      if(b && b->refcnt == 0 && (victim == 0 || b->lastuse < victim->lastuse))
+        victim = b;
+    }
+    if(victim == 0){
+      scan_end();
+      return 0;
+    }
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    // victim may have been taken, or moved to another bucket,
+    // since the scan.
+    bk = &bcache.bucket[victim->bucket];
+    acquire(&bk->lock);
+    if(bk == &bcache.bucket[victim->bucket] && victim->refcnt == 0){
+      bucket_remove(bk, victim);
+      victim->refcnt = 1;
+      release(&bk->lock);
+      scan_end();
+      return victim;
+    }
+    release(&bk->lock);
+    scan_end();
+    __sync_fetch_and_add(&bcache.nretry, 1);
   }
 }
 
+// Wait until some buffer's refcnt may have dropped to 0
+// since gen was read.
+static void
+bwaitfree(int gen)
+{
+  acquire(&bcache.lock);
+  while(bcache.gen == gen)
+    sleep(&bcache.gen, &bcache.lock);
+  bcache.nwaiting--;
+  release(&bcache.lock);
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// At most one bucket lock is held at a time.
 static struct buf*
 bget(uint dev, uint blockno)
 {
-  struct buf *b;
+  struct bucket *bk;
+  struct buf *b, *victim;
+  int gen;
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[HASH(dev, blockno)];
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
+  for(;;){
+    // Is the block already cached?
+    acquire(&bk->lock);
+    if((b = bucket_lookup(bk, dev, blockno)) != 0){
+      bk->nhit++;
+      release(&bk->lock);
       acquiresleep(&b->lock);
       return b;
     }
-  }
+    release(&bk->lock);
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+    // Not cached.
+    // Grow the cache if memory allows, else recycle the least
+    // recently used (LRU) unused buffer, else wait for one.
+    victim = 0;
+    if(kfreepages() > BRESERVE)
+      victim = grow();
+    if(victim == 0){
+      acquire(&bcache.lock);
+      bcache.nwaiting++;
+      gen = bcache.gen;
+      release(&bcache.lock);
+      if((victim = evict()) == 0){
+        __sync_fetch_and_add(&bcache.nwait, 1);
+        bwaitfree(gen);
+        continue;
+      }
+      acquire(&bcache.lock);
+      bcache.nwaiting--;
       release(&bcache.lock);
+    }
+
+    acquire(&bk->lock);
+    if((b = bucket_lookup(bk, dev, blockno)) != 0){
+      // someone else cached it meanwhile; park the victim here
+      // as an empty buffer.
+      bk->nhit++;
+      victim->dev = NODEV;
+      victim->valid = 0;
+      victim->refcnt = 0;
+      victim->lastuse = 0;
+      bucket_insert(bk, victim);
+      release(&bk->lock);
       acquiresleep(&b->lock);
       return b;
     }
+    bk->nmiss++;
+    victim->dev = dev;
+    victim->blockno = blockno;
+    victim->valid = 0;
+    bucket_insert(bk, victim);
+    release(&bk->lock);
+    acquiresleep(&victim->lock);
+    return victim;
   }
-  panic("bget: no buffers");
+}
+
+// Free unreferenced buffers, down to half the cache but no fewer
+// than NBUF, and return their pages to kalloc(). Called by
+// kalloc() when memory runs out, so takes no lock that might be
+// held around a call to kalloc(). Returns the pages freed.
+int
+bshrink(void)
+{
+  struct bucket *bk;
+  struct buf *b, *next;
+  int goal, n;
+
+  // exclude evict()'s scans. If another bshrink() is running,
+  // leave the freeing to it.
+  if(__sync_lock_test_and_set(&bcache.shrinking, 1))
+    return 0;
+  __sync_synchronize();
+  while(__sync_fetch_and_add(&bcache.nscan, 0) > 0)
+    ;
+
+  goal = bcache.nbuf / 2;
+  if(goal < NBUF)
+    goal = NBUF;
+  n = 0;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    if(bcache.nbuf <= goal)
+      break;
+    acquire(&bk->lock);
+    for(b = bk->head; b && bcache.nbuf > goal; b = next){
+      next = b->next;
+      if(b->refcnt == 0){
+        bucket_remove(bk, b);
+        bcache.buf[b->slot] = 0;
+        __sync_fetch_and_sub(&bcache.nbuf, 1);
+        kmem_cache_free(bcache.cache, b);
+        n++;
+      }
+    }
+    release(&bk->lock);
+  }
+  __sync_lock_release(&bcache.shrinking);
+  __sync_fetch_and_add(&bcache.nshrink, n);
+  return n ? kmem_cache_shrink(bcache.cache) : 0;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -96,58 +359,206 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    blk_rw(b, 0);
     b->valid = 1;
   }
   return b;
 }
 
+// Return a locked buf for a block the caller will overwrite
+// entirely, without reading the old contents from disk.
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->valid = 1;
+  return b;
+}
+
+// Return locked bufs with the contents of the n consecutive
+// blocks starting at blockno in bs[0..n-1], reading the ones
+// not in the cache with as few disk requests as possible.
+void
+breadv(uint dev, uint blockno, int n, struct buf **bs)
+{
+  struct buf *miss[MAXSEG];
+  int i, nmiss;
+
+  if(n < 1 || n > MAXSEG)
+    panic("breadv");
+  nmiss = 0;
+  for(i = 0; i < n; i++){
+    bs[i] = bget(dev, blockno + i);
+    if(!bs[i]->valid)
+      miss[nmiss++] = bs[i];
+  }
+  blk_submit(miss, nmiss, 0);
+  for(i = 0; i < nmiss; i++){
+    blk_wait(miss[i]);
+    miss[i]->valid = 1;
+  }
+}
+
+static void brelease(struct buf *b);
+
+// Called from virtio_disk_intr() when a readahead finishes:
+// the data is valid, and the buffer is released on behalf of
+// the process that started the read.
+static void
+breadahead_done(struct buf *b)
+{
+  b->iodone = 0;
+  b->valid = 1;
+  brelease(b);
+}
+
+// Start reading the n (at most MAXSEG) blocks listed in
+// blocknos into the cache, skipping those already there,
+// without waiting for the disk.
+void
+breadahead(uint dev, uint *blocknos, int n)
+{
+  struct buf *b, *miss[MAXSEG];
+  int i, nmiss;
+
+  if(n > MAXSEG)
+    panic("breadahead");
+  nmiss = 0;
+  for(i = 0; i < n; i++){
+    b = bget(dev, blocknos[i]);
+    if(b->valid){
+      brelse(b);
+      continue;
+    }
+    b->iodone = breadahead_done;
+    miss[nmiss++] = b;
+  }
+  __sync_fetch_and_add(&bcache.nreadahead, nmiss);
+  blk_submit(miss, nmiss, 0);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  blk_rw(b, 1);
+}
+
+// Start writing b's contents to disk, and return without
+// waiting. b must be locked, and stays locked; do not change
+// b->data until bwait(b) returns.
+void
+bwrite_async(struct buf *b)
+{
+  bwritev_async(&b, 1);
+}
+
+// bwrite_async() each of bs[0..n-1], in any order; the block
+// queue sorts them and merges writes of consecutive blocks.
+void
+bwritev_async(struct buf **bs, int n)
+{
+  for(int i = 0; i < n; i++)
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwrite_async");
+  blk_submit(bs, n, 1);
+}
+
+// Wait for a bwrite_async() of b to finish.  Must be locked.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  blk_wait(b);
 }
 
-// Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Release a locked buffer, waiting for any write to finish.
+// Record when it was last used, for LRU eviction.
 void
 brelse(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("brelse");
+  if(b->disk)
+    blk_wait(b);
+  brelease(b);
+}
+
+// Release b's lock and reference, whoever holds them.
+static void
+brelease(struct buf *b)
+{
+  struct bucket *bk;
+  int free;
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[b->bucket];
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
+  free = b->refcnt == 0;
+  if (free) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = ticks;
+  }
+  release(&bk->lock);
+
+  if(free && bcache.nwaiting > 0){
+    acquire(&bcache.lock);
+    bcache.gen++;
+    wakeup(&bcache.gen);
+    release(&bcache.lock);
   }
-  
-  release(&bcache.lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[b->bucket];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[b->bucket];
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
+}
+
+// Report hit rate and bucket lock contention
+// for the statistics device.
+int
+bcachestats(char *buf, int sz)
+{
+  struct bucket *bk;
+  int nhit, nmiss, nacq, nts, n;
+
+  nhit = nmiss = nacq = nts = 0;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    nhit += bk->nhit;
+    nmiss += bk->nmiss;
+    nacq += bk->lock.n;
+    nts += bk->lock.nts;
+  }
+  n = snprintf(buf, sz,
+               "bcache: hit %d miss %d retry %d "
+               "#acquire %d #test-and-set %d\n",
+               nhit, nmiss, bcache.nretry, nacq, nts);
+  n += snprintf(buf+n, sz-n,
+                "bcache size: bufs %d grow %d shrink %d wait %d "
+                "readahead %d\n",
+                bcache.nbuf, bcache.ngrow, bcache.nshrink, bcache.nwait,
+                bcache.nreadahead);
+  return n;
 }
 
 
@@ -0,0 +1,349 @@
+// Block request queues, between the buffer cache and the disk driver.
+//
+// blk_submit() does not hand bufs to the device directly. It puts
+// them on a queue of pending requests kept sorted by block number,
+// merging each buf into a pending request for the block just
+// before or after it, so that a batch submitted in any order goes
+// out as a few large transfers in disk order. Requests are
+// dispatched to the driver, in one-way elevator order from where
+// the last one ended, for as long as the device has room; when it
+// is full, the rest wait until virtio_disk_intr() reports a
+// completion and calls blk_dispatch().
+//
+// The file system is striped over all the disks (RAID-0): block b
+// is block STRIPEBLOCK(b) of disk STRIPEDISK(b), so a sequential
+// transfer keeps every disk busy. Queues hold and merge requests
+// by disk block number.
+//
+// Each disk has one such queue per device queue (virtqueue), and
+// each hart submits to queue cpuid() % nq, so harts with queues of
+// their own share neither a lock nor a ring with each other.
+//
+// A buf is owned by the disk (b->disk == 1) from blk_submit()
+// until its transfer finishes, whether or not it has been
+// dispatched yet, so blk_wait() and brelse() work the same way
+// for queued and in-flight bufs.
+//
+// Lock order: a queue's lock, then the driver's lock for it.
+//
+// The driver is virtio_disk.c, or ramdisk.c in a RAMDISK=1
+// build, whose transfers finish as soon as they are dispatched.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+
+#define NREQ 64   // pending requests per queue
+
+struct request {
+  struct request *next;   // queue, sorted by (dev, start), or free list
+  int write;
+  uint start;             // disk block of bs[0]
+  int n;
+  struct buf *bs[MAXSEG]; // consecutive disk blocks
+};
+
+struct blkq {
+  struct spinlock lock;
+  struct request req[NREQ];
+  struct request *queue;
+  struct request *free;
+  int npending;           // requests on queue
+  uint dev, pos;          // where the last dispatched request ended
+
+  // statistics, protected by lock.
+  uint64 nbuf;            // bufs submitted
+  uint64 nback;           // bufs appended to a pending request
+  uint64 nfront;          // bufs prepended to a pending request
+  uint64 ndispatch;       // requests handed to the driver
+  uint64 nfull;           // dispatches refused because the device was full
+};
+
+static struct blkq blkq[NDISK][NCPU];
+static int ndisk;         // disks striped together
+static int nq[NDISK];     // queues in use on each disk
+
+// how many blocks of disk d the file system uses.
+static uint
+disksize(int d)
+{
+  for(int b = FSSIZE - 1; b >= 0; b--)
+    if(STRIPEDISK(b, ndisk) == d)
+      return STRIPEBLOCK(b, ndisk) + 1;
+  return 0;
+}
+
+// called after the disk driver is initialized.
+void
+blkinit(void)
+{
+#ifdef BLK_RAMDISK
+  ndisk = 1;
+  nq[0] = 1;
+#else
+  ndisk = virtio_disk_ndisk();
+  for(int d = 0; d < ndisk; d++){
+    nq[d] = virtio_disk_nqueue(d);
+    if(virtio_disk_size(d) < disksize(d))
+      panic("blkinit: disk too small");
+  }
+#endif
+  for(int d = 0; d < ndisk; d++){
+    for(int q = 0; q < nq[d]; q++){
+      initlock(&blkq[d][q].lock, "blkq");
+      for(int i = 0; i < NREQ; i++){
+        blkq[d][q].req[i].next = blkq[d][q].free;
+        blkq[d][q].free = &blkq[d][q].req[i];
+      }
+    }
+  }
+}
+
+// How many disks the file system is striped over.
+int
+blk_ndisk(void)
+{
+  return ndisk;
+}
+
+// does (dev, start) sort before request r?
+static int
+before(uint dev, uint start, struct request *r)
+{
+  uint rdev = r->bs[0]->dev;
+
+  return dev < rdev || (dev == rdev && start < r->start);
+}
+
+// Try to add b, for disk block pb, to a pending request for an
+// adjacent disk block. Caller must hold bq->lock.
+static int
+merge(struct blkq *bq, struct buf *b, uint pb, int write)
+{
+  struct request *r;
+
+  for(r = bq->queue; r; r = r->next){
+    if(r->write != write || r->n == MAXSEG || r->bs[0]->dev != b->dev)
+      continue;
+    if(pb == r->start + r->n){
+      r->bs[r->n++] = b;
+      bq->nback++;
+      return 1;
+    }
+    if(pb + 1 == r->start){
+      for(int i = r->n; i > 0; i--)
+        r->bs[i] = r->bs[i-1];
+      r->bs[0] = b;
+      r->start = pb;
+      r->n++;
+      bq->nfront++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Give request r to the driver's queue q of disk d.
+// Returns -1 if the device is full.
+static int
+start(int d, int q, struct request *r)
+{
+#ifdef BLK_RAMDISK
+  ramdiskrw(r->bs, r->n, r->write);
+  return 0;
+#else
+  return virtio_disk_start(d, q, r->start, r->bs, r->n, r->write);
+#endif
+}
+
+// Hand the pending requests of queue q of disk d to the driver,
+// in elevator order, until the queue is empty or the device is
+// full. Caller must hold the queue's lock.
+static void
+dispatch(int d, int q)
+{
+  struct blkq *bq = &blkq[d][q];
+  struct request *r, **rp;
+
+  if(bq->queue == 0)
+    return;
+#ifndef BLK_RAMDISK
+  virtio_disk_plug(d, q);
+#endif
+  while(bq->queue){
+    // the first request beyond the last one's end,
+    // or else go back to the start.
+    for(rp = &bq->queue; *rp && !before(bq->dev, bq->pos, *rp); rp = &(*rp)->next)
+      ;
+    if(*rp == 0)
+      rp = &bq->queue;
+
+    r = *rp;
+    if(start(d, q, r) < 0){
+      bq->nfull++;
+      break;
+    }
+    bq->ndispatch++;
+    bq->dev = r->bs[0]->dev;
+    bq->pos = r->start + r->n - 1;
+    *rp = r->next;
+    bq->npending--;
+    r->next = bq->free;
+    bq->free = r;
+    wakeup(&bq->free);
+  }
+#ifndef BLK_RAMDISK
+  virtio_disk_unplug(d, q);
+#endif
+}
+
+// Add b, for block pb of disk d, to queue q.
+// Caller must hold the queue's lock.
+static void
+enqueue(int d, int q, struct buf *b, uint pb, int write)
+{
+  struct blkq *bq = &blkq[d][q];
+  struct request *r, **rp;
+
+  b->disk = 1;
+  b->hwdisk = d;
+  b->hwq = q;
+  bq->nbuf++;
+  if(merge(bq, b, pb, write))
+    return;
+
+  while(bq->free == 0){
+    // make room by starting what the device will take,
+    // or else wait for it to finish something.
+    dispatch(d, q);
+    if(bq->free == 0)
+      sleep(&bq->free, &bq->lock);
+  }
+  r = bq->free;
+  bq->free = r->next;
+  r->write = write;
+  r->start = pb;
+  r->n = 1;
+  r->bs[0] = b;
+  for(rp = &bq->queue; *rp && !before(b->dev, pb, *rp); rp = &(*rp)->next)
+    ;
+  r->next = *rp;
+  *rp = r;
+  bq->npending++;
+}
+
+// Queue transfers of the locked bufs bs[0..n-1], in any order,
+// and start as many as the devices will take. Returns without
+// waiting for them; see blk_wait().
+void
+blk_submit(struct buf **bs, int n, int write)
+{
+  struct blkq *bq;
+  int cpu, d, q, i, queued;
+
+  push_off();
+  cpu = cpuid();
+  pop_off();
+
+  // one disk at a time, so each queue's lock is taken once.
+  for(d = 0; d < ndisk; d++){
+    q = cpu % nq[d];
+    bq = &blkq[d][q];
+    queued = 0;
+    for(i = 0; i < n; i++){
+      if(STRIPEDISK(bs[i]->blockno, ndisk) != d)
+        continue;
+      if(queued++ == 0)
+        acquire(&bq->lock);
+      enqueue(d, q, bs[i], STRIPEBLOCK(bs[i]->blockno, ndisk), write);
+    }
+    if(queued){
+      dispatch(d, q);
+      release(&bq->lock);
+    }
+  }
+}
+
+// Start the pending requests of queue q of disk d if the device
+// has room. Called by the driver, without its lock, when requests
+// on that queue finish. A request queued after the unlocked check
+// below is dispatched by its submitter, who sees the descriptors
+// this completion freed.
+void
+blk_dispatch(int d, int q)
+{
+  struct blkq *bq = &blkq[d][q];
+
+  if(bq->queue == 0)
+    return;
+  acquire(&bq->lock);
+  dispatch(d, q);
+  release(&bq->lock);
+}
+
+// Wait for the transfer of b to finish.
+void
+blk_wait(struct buf *b)
+{
+#ifdef BLK_RAMDISK
+  if(b->disk)
+    panic("blk_wait");
+#else
+  virtio_disk_wait(b);
+#endif
+}
+
+// Read or write b, and wait for the disk to finish.
+void
+blk_rw(struct buf *b, int write)
+{
+  blk_submit(&b, 1, write);
+  blk_wait(b);
+}
+
+// Make every transfer that has finished durable, by flushing the
+// disks' write caches. A ramdisk has nothing to flush.
+void
+blk_flush(void)
+{
+#ifndef BLK_RAMDISK
+  for(int d = 0; d < ndisk; d++)
+    virtio_disk_flush(d);
+#endif
+}
+
+// Report how well requests merge, summed over the disks and
+// their queues, for the statistics device. merged is the percentage of submitted
+// bufs that joined a pending request rather than starting one.
+int
+blkstats(char *buf, int sz)
+{
+  uint64 nbuf = 0, nback = 0, nfront = 0, ndispatch = 0, nfull = 0;
+  int npending = 0;
+
+  for(int d = 0; d < ndisk; d++){
+    for(int q = 0; q < nq[d]; q++){
+      struct blkq *bq = &blkq[d][q];
+
+      acquire(&bq->lock);
+      nbuf += bq->nbuf;
+      nback += bq->nback;
+      nfront += bq->nfront;
+      ndispatch += bq->ndispatch;
+      nfull += bq->nfull;
+      npending += bq->npending;
+      release(&bq->lock);
+    }
+  }
+  return snprintf(buf, sz,
+                  "blkq: bufs %d back-merged %d front-merged %d "
+                  "dispatched %d merged %d%% pending %d full %d\n",
+                  (int)nbuf, (int)nback, (int)nfront, (int)ndispatch,
+                  nbuf ? (int)((nback + nfront) * 100 / nbuf) : 0,
+                  npending, (int)nfull);
+}
@@ -1,3 +1,9 @@
+// request classes, each with its own completion poll budget;
+// see virtio_disk_wait().
+#define IOC_DATA  0   // ordinary reads and writes
+#define IOC_LOG   1   // writes during a log commit
+#define NIOCLASS  2
+
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
@@ -5,8 +11,15 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  uint bucket;      // bcache hash bucket
+  uint slot;        // index in bcache.buf[]
+  uint lastuse;     // ticks at last brelse, for LRU eviction
+  struct buf *next; // bucket's hash chain
+  void (*iodone)(struct buf*); // if set, called when async I/O finishes
+  struct buf *qnext; // next buf in the same disk request
+  int ioclass;      // IOC_DATA unless the holder says otherwise
+  int hwdisk;       // disk of the last request, set by blkq.c
+  int hwq;          // and its device queue
   uchar data[BSIZE];
 };
 
@@ -6,6 +6,7 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct spinlock;
@@ -20,13 +21,31 @@ struct sock;
 #define max(a, b) ((a) > (b) ? (a) : (b))
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// blkq.c
+void            blkinit(void);
+int             blk_ndisk(void);
+void            blk_submit(struct buf**, int, int);
+void            blk_dispatch(int, int);
+void            blk_wait(struct buf*);
+void            blk_rw(struct buf*, int);
+void            blk_flush(void);
+int             blkstats(char*, int);
+
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bnew(uint, uint);
+void            breadahead(uint, uint*, int);
+void            breadv(uint, uint, int, struct buf**);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwrite_async(struct buf*);
+void            bwritev_async(struct buf**, int);
+void            bwait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bcachestats(char*, int);
+int             bshrink(void);
 
 // console.c
 void            consoleinit(void);
@@ -53,6 +72,7 @@ struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit();
+int             ishrink(void);
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
@@ -62,27 +82,42 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+void            ireadahead(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
 
 // ramdisk.c
 void            ramdiskinit(void);
-void            ramdiskintr(void);
-void            ramdiskrw(struct buf*);
+void            ramdiskrw(struct buf**, int, int);
+int             ramdiskstats(char*, int);
 
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void*           kalloc_order(int);
+void            kfree_order(void *, int);
+void*           kalloc_zeroed(void);
+int             kfreepages(void);
+void            kzeroinit(void);
+int             kallocstats(char*, int);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+void            log_free(uint);
+int             log_pending(uint);
+int             logstats(char*, int);
 void            begin_op(void);
+void            begin_opn(int);
 void            end_op(void);
+uint            log_seq(void);
+int             log_sync(uint);
+void            log_setsync(int);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -102,6 +137,7 @@ void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+struct proc*    kthread(void (*)(void), char*);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
@@ -116,14 +152,30 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+void            wakeupproc(struct proc*, void*);
+int             bootstats(char*, int);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 
+// start.c
+extern uint64   boottime;
+
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+int             kmem_cache_shrink(struct kmem_cache*);
+int             slabstats(char*, int);
+
+// sprintf.c
+int             snprintf(char*, int, char*, ...);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
@@ -144,6 +196,9 @@ void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// stats.c
+void            statsinit(void);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -167,6 +222,7 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            vclobber(void);
 
 // uart.c
 void            uartinit(void);
@@ -206,8 +262,17 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
-void            virtio_disk_intr(void);
+int             virtio_disk_ndisk(void);
+int             virtio_disk_nqueue(int);
+uint64          virtio_disk_size(int);
+int             virtio_disk_start(int, int, uint, struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
+void            virtio_disk_flush(int);
+void            virtio_disk_plug(int, int);
+void            virtio_disk_unplug(int, int);
+void            virtio_disk_intr(int);
+int             virtio_disk_stats(char*, int);
+int             virtio_disk_setpoll(int, int);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -220,14 +285,6 @@ int             copyin_new(pagetable_t, char *, uint64, uint64);
 int             copyinstr_new(pagetable_t, char *, uint64, uint64);
 #endif
 
-#ifdef LAB_LOCK
-// stats.c
-void            statsinit(void);
-void            statsinc(void);
-
-// sprintf.c
-int             snprintf(char*, int, char*, ...);
-#endif
 
 #ifdef KCSAN
 void            kcsaninit();
@@ -14,15 +14,20 @@
 #include "proc.h"
 
 struct devsw devsw[NDEV];
+
+// file structures come from a slab cache, so the number of
+// open files is limited only by memory. ftable.lock protects
+// every file's ref.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kmem_cache_create("file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -31,16 +36,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -72,11 +72,15 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(ftable.cache, f);
+
+  if(ff.snap)
+    kfree(ff.snap);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
-    begin_op();
+    begin_opn(IPUTBLOCKS);
     iput(ff.ip);
     end_op();
   }
@@ -101,6 +105,42 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Start reading ahead for a read of n bytes at f->off.
+// Each read that continues where the last one left off
+// doubles the readahead window, up to RAMAX blocks;
+// any other read turns readahead off until the next
+// sequential one. Caller must hold f->ip->lock.
+static void
+readahead(struct file *f, int n)
+{
+  uint first, last, start, end;
+
+  if(n <= 0)
+    return;
+  first = f->off / BSIZE;
+  last = (f->off + n - 1) / BSIZE;
+
+  if(first == f->ra_next){
+    f->ra_win = f->ra_win ? f->ra_win * 2 : RAMIN;
+    if(f->ra_win > RAMAX)
+      f->ra_win = RAMAX;
+  } else {
+    f->ra_win = 0;
+    f->ra_end = 0;
+  }
+  f->ra_next = (f->off + n) / BSIZE;
+  if(f->ra_win == 0)
+    return;
+
+  // the blocks of this read, and a window past them.
+  start = first > f->ra_end ? first : f->ra_end;
+  end = last + 1 + f->ra_win;
+  if(start < end){
+    ireadahead(f->ip, start, end - start);
+    f->ra_end = end;
+  }
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -116,9 +156,10 @@ fileread(struct file *f, uint64 addr, int n)
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
-    r = devsw[f->major].read(1, addr, n);
+    r = devsw[f->major].read(f, 1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
+    readahead(f, n);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
     iunlock(f->ip);
@@ -147,19 +188,20 @@ filewrite(struct file *f, uint64 addr, int n)
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // the maximum op size, including i-node, indirect
+    // block, allocation blocks, and 1 block of slop for
+    // non-aligned writes; see WRITEBLOCKS(). In ordered
+    // mode only the op's length limits it.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = WRITEMAX;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      begin_opn(WRITEBLOCKS(n1));
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
@@ -191,12 +233,8 @@ writeback(struct file *f, off_t off, uint64 addr, int nr_page) {
     return -1;
 
   // write a few blocks at a time to avoid exceeding
-  // the maximum log transaction size, including
-  // i-node, indirect block, allocation blocks,
-  // and 2 blocks of slop for non-aligned writes.
-  // this really belongs lower down, since writei()
-  // might be writing a device like the console.
-  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  // the maximum op size; see filewrite().
+  int max = WRITEMAX;
   int i = 0;
 
   n = nr_page * PGSIZE;
@@ -205,7 +243,7 @@ writeback(struct file *f, off_t off, uint64 addr, int nr_page) {
     if (n1 > max)
       n1 = max;
 
-    begin_op();
+    begin_opn(WRITEBLOCKS(n1));
     ilock(f->ip);
     if ((r = writei(f->ip, 1, addr + i, off, n1)) > 0)
       off += r;
@@ -5,8 +5,13 @@ struct file {
   char writable;
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
-  uint off;          // FD_INODE
+  uint off;          // FD_INODE, and FD_DEVICE for statistics
+  uint ra_next;      // FD_INODE: file block a sequential read starts at
+  uint ra_end;       // FD_INODE: readahead started up to here
+  uint ra_win;       // FD_INODE: blocks to read ahead, 0 if not sequential
   short major;       // FD_DEVICE
+  char *snap;        // FD_DEVICE: statistics snapshot, see stats.c
+  int snapsz;        // FD_DEVICE: bytes in snap, 0 if none yet
 };
 
 #define major(dev)  ((dev) >> 16 & 0xFFFF)
@@ -18,6 +23,8 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // itable hash chain
+  struct inode *lnext, *lprev; // itable LRU list, while ref == 0
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -27,14 +34,16 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+  uint logseq;        // log transaction that last changed it
 };
 
 // map major device number to device functions.
 struct devsw {
-  int (*read)(int, uint64, int);
+  int (*read)(struct file*, int, uint64, int);
   int (*write)(int, uint64, int);
 };
 
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define STATS   2
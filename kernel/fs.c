@@ -43,16 +43,26 @@ fsinit(int dev) {
   readsb(dev, &sb);
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
+  // the superblock is on the first disk however many there are.
+  if(sb.ndisk != blk_ndisk())
+    panic("file system striped over a different number of disks");
   initlog(dev, &sb);
 }
 
+#ifdef LOG_JOURNALDATA
+#define ORDERED(ip) 0
+#else
+// ordered mode: writei() writes ip's data in place, not to the log.
+#define ORDERED(ip) ((ip)->type == T_FILE)
+#endif
+
 // Zero a block.
 static void
 bzero(int dev, int bno)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bnew(dev, bno);
   memset(bp->data, 0, BSIZE);
   log_write(bp);
   brelse(bp);
@@ -60,10 +70,12 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Allocate a zeroed disk block. If inplace, it is for data that
+// writei() writes in place, so skip blocks the log still needs,
+// and leave the zeroing to writei(), which writes the block.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc(uint dev, int inplace)
 {
   int b, bi, m;
   struct buf *bp;
@@ -74,10 +86,13 @@ balloc(uint dev)
     for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
       m = 1 << (bi % 8);
       if((bp->data[bi/8] & m) == 0){  // Is block free?
+        if(inplace && log_pending(b + bi))
+          continue;
         bp->data[bi/8] |= m;  // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
+        if(!inplace)
+          bzero(dev, b + bi);
         return b + bi;
       }
     }
@@ -102,6 +117,7 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  log_free(b);
 }
 
 // Inodes.
@@ -164,29 +180,79 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// In-memory inodes come from a slab cache and are kept in a hash
+// table indexed by (dev, inum). When the last iput() drops a valid
+// inode, it stays in the table, on an LRU list of unreferenced
+// inodes, so that the next iget() of it need not read the disk;
+// kalloc() calls ishrink() to free those when memory runs out.
+//
+// The itable.lock spin-lock protects the hash table and the LRU
+// list. Since ip->ref indicates whether an entry is in use, and
+// ip->dev and ip->inum indicate which i-node an entry holds, one
+// must hold itable.lock while using any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// dev, inum, next, and the LRU links.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 31
+#define IHASH(dev, inum) (((dev) * 131 + (inum)) % NIHASH)
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmem_cache *cache;
+  struct inode *hash[NIHASH];
+  struct inode *lru;      // unreferenced inodes, least recently used first
+  struct inode *lrutail;
 } itable;
 
+// add ip, which has just lost its last reference, to the LRU list.
+// Caller must hold itable.lock.
+static void
+lru_add(struct inode *ip)
+{
+  ip->lnext = 0;
+  ip->lprev = itable.lrutail;
+  if(itable.lrutail)
+    itable.lrutail->lnext = ip;
+  else
+    itable.lru = ip;
+  itable.lrutail = ip;
+}
+
+// Caller must hold itable.lock.
+static void
+lru_remove(struct inode *ip)
+{
+  if(ip->lprev)
+    ip->lprev->lnext = ip->lnext;
+  else
+    itable.lru = ip->lnext;
+  if(ip->lnext)
+    ip->lnext->lprev = ip->lprev;
+  else
+    itable.lrutail = ip->lprev;
+  ip->lnext = ip->lprev = 0;
+}
+
+// take ip out of the hash table and free it.
+// Caller must hold itable.lock.
+static void
+ifree(struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = &itable.hash[IHASH(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->next)
+    ;
+  *pp = ip->next;
+  kmem_cache_free(itable.cache, ip);
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  itable.cache = kmem_cache_create("inode", sizeof(struct inode));
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -238,6 +304,7 @@ iupdate(struct inode *ip)
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
+  ip->logseq = log_seq();
 }
 
 // Find the inode with number inum on device dev
@@ -246,31 +313,43 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, *new;
 
+  new = 0;
   acquire(&itable.lock);
-
-  // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
+  for(;;){
+    // Is the inode already in the table?
+    for(ip = itable.hash[IHASH(dev, inum)]; ip; ip = ip->next){
+      if(ip->dev == dev && ip->inum == inum){
+        if(ip->ref++ == 0)
+          lru_remove(ip);
+        release(&itable.lock);
+        if(new)
+          kmem_cache_free(itable.cache, new);
+        return ip;
+      }
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
-  }
+    if(new)
+      break;
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+    // Not there. Allocate an entry without holding the
+    // lock, then look again in case another process
+    // added the inode meanwhile.
+    release(&itable.lock);
+    if((new = kmem_cache_alloc(itable.cache)) == 0)
+      panic("iget: no inodes");
+    initsleeplock(&new->lock, "inode");
+    acquire(&itable.lock);
+  }
 
-  ip = empty;
+  ip = new;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->lnext = ip->lprev = 0;
+  ip->next = itable.hash[IHASH(dev, inum)];
+  itable.hash[IHASH(dev, inum)] = ip;
   release(&itable.lock);
 
   return ip;
@@ -310,6 +389,9 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    // it may have changed in a transaction that has not
+    // committed yet; assume the open one.
+    ip->logseq = log_seq();
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -327,8 +409,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode table entry is
+// kept on the LRU list if it is valid, or else freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -358,9 +440,35 @@ iput(struct inode *ip)
   }
 
   ip->ref--;
+  if(ip->ref == 0){
+    if(ip->valid)
+      lru_add(ip);
+    else
+      ifree(ip);
+  }
   release(&itable.lock);
 }
 
+// Free the unreferenced inodes on the LRU list, and return
+// their pages to kalloc(). Called by kalloc() when memory runs
+// out, like bshrink(). Returns the pages freed.
+int
+ishrink(void)
+{
+  struct inode *ip;
+  int n;
+
+  n = 0;
+  acquire(&itable.lock);
+  while((ip = itable.lru) != 0){
+    lru_remove(ip);
+    ifree(ip);
+    n++;
+  }
+  release(&itable.lock);
+  return n ? kmem_cache_shrink(itable.cache) : 0;
+}
+
 // Common idiom: unlock, then put.
 void
 iunlockput(struct inode *ip)
@@ -387,7 +495,7 @@ bmap(struct inode *ip, uint bn)
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, ORDERED(ip));
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
@@ -399,7 +507,7 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, 0);
       if(addr == 0)
         return 0;
       ip->addrs[NDIRECT] = addr;
@@ -407,7 +515,7 @@ bmap(struct inode *ip, uint bn)
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, ORDERED(ip));
       if(addr){
         a[bn] = addr;
         log_write(bp);
@@ -464,6 +572,46 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Start reading up to n of ip's data blocks, from file block
+// bn on, into the buffer cache without waiting for them.
+// Stops at the end of the file, so bmap() never allocates.
+// Caller must hold ip->lock.
+void
+ireadahead(struct inode *ip, uint bn, uint n)
+{
+  uint addrs[MAXSEG], nblock;
+  int m;
+
+  nblock = (ip->size + BSIZE - 1) / BSIZE;
+  while(n > 0 && bn < nblock){
+    for(m = 0; m < MAXSEG && n > 0 && bn < nblock; m++, bn++, n--)
+      if((addrs[m] = bmap(ip, bn)) == 0)
+        break;
+    breadahead(ip->dev, addrs, m);
+    if(m < MAXSEG && n > 0 && bn < nblock)
+      break;  // bmap() failed
+  }
+}
+
+// Find how many of ip's blocks from bn on, up to the one
+// holding byte end-1 and at most MAXSEG, are consecutive on
+// disk. Sets *addr to the first one's address; returns 0 if
+// bmap() fails.
+static int
+bmaprun(struct inode *ip, uint bn, uint end, uint *addr)
+{
+  uint last;
+  int n;
+
+  if((*addr = bmap(ip, bn)) == 0)
+    return 0;
+  last = (end - 1) / BSIZE;
+  for(n = 1; n < MAXSEG && bn + n <= last; n++)
+    if(bmap(ip, bn + n) != *addr + n)
+      break;
+  return n;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -471,28 +619,33 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
+  uint tot, m, addr;
+  struct buf *bs[MAXSEG];
+  int i, nb, err;
 
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
 
-  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
-    if(addr == 0)
-      break;
-    bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
-      brelse(bp);
-      tot = -1;
+  // read each run of blocks that are consecutive on disk
+  // with a single request.
+  err = 0;
+  for(tot=0; tot<n && !err; ){
+    if((nb = bmaprun(ip, off/BSIZE, off + n - tot, &addr)) == 0)
       break;
+    breadv(ip->dev, addr, nb, bs);
+    for(i = 0; i < nb; i++){
+      if(!err){
+        m = min(n - tot, BSIZE - off%BSIZE);
+        if(either_copyout(user_dst, dst, bs[i]->data + (off % BSIZE), m) == -1)
+          err = 1;
+        tot += m, off += m, dst += m;
+      }
+      brelse(bs[i]);
     }
-    brelse(bp);
   }
-  return tot;
+  return err ? -1 : tot;
 }
 
 // Write data to inode.
@@ -502,38 +655,77 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 // Returns the number of bytes successfully written.
 // If the return value is less than the requested n,
 // there was an error of some kind.
+// In ordered mode a file's data blocks are written in place,
+// one request per run, and the disk has them when writei()
+// returns (in its cache, until a commit or fdatasync() flushes
+// it); only the inode, indirect block and bitmap are logged,
+// and the inode only if the size or block list changed.
+// Blocks past the file's last one are zeroed here rather
+// than by balloc(), so the zeroes go to disk with the data.
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
+  uint tot, m, addr, end, nblock;
+  struct buf *bs[MAXSEG];
+  int i, nb, nw, err, grow;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
-  for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    uint addr = bmap(ip, off/BSIZE);
-    if(addr == 0)
-      break;
-    bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
-      brelse(bp);
+  // read each run of blocks that are consecutive on disk
+  // with a single request. in ordered mode a run does not
+  // straddle nblock, so it is either all old or all new.
+  nblock = (ip->size + BSIZE - 1) / BSIZE;
+  grow = off + n > nblock*BSIZE;
+  err = 0;
+  for(tot=0; tot<n && !err; ){
+    end = off + n - tot;
+    if(ORDERED(ip) && off/BSIZE < nblock && end > nblock*BSIZE)
+      end = nblock*BSIZE;
+    if((nb = bmaprun(ip, off/BSIZE, end, &addr)) == 0)
       break;
+    if(ORDERED(ip) && off/BSIZE >= nblock){
+      // beyond the old end of file: nothing on disk to keep,
+      // whatever an earlier failed writei() left there.
+      for(i = 0; i < nb; i++){
+        bs[i] = bnew(ip->dev, addr + i);
+        memset(bs[i]->data, 0, BSIZE);
+      }
+    } else
+      breadv(ip->dev, addr, nb, bs);
+    nw = 0;
+    for(i = 0; i < nb && !err; i++){
+      m = min(n - tot, BSIZE - off%BSIZE);
+      if(either_copyin(bs[i]->data + (off % BSIZE), user_src, src, m) == -1)
+        err = 1;
+      else {
+        if(!ORDERED(ip))
+          log_write(bs[i]);
+        nw++;
+        tot += m, off += m, src += m;
+      }
     }
-    log_write(bp);
-    brelse(bp);
+    if(ORDERED(ip))
+      bwritev_async(bs, nw);
+    for(i = 0; i < nb; i++)
+      brelse(bs[i]);  // waits for the writes
   }
 
-  if(off > ip->size)
+  if(off > ip->size){
     ip->size = off;
+    grow = 1;
+  }
 
-  // write the i-node back to disk even if the size didn't change
-  // because the loop above might have called bmap() and added a new
-  // block to ip->addrs[].
-  iupdate(ip);
+  // write the i-node back to disk if the size changed, or if the
+  // write went past the last block, because then the loop above
+  // might have called bmap() and added a new block to ip->addrs[]
+  // even if it failed. the blocks before that are all mapped.
+  if(grow)
+    iupdate(ip);
+  else if(tot > 0 && !ORDERED(ip))
+    ip->logseq = log_seq();  // the data is in the log
 
   return tot;
 }
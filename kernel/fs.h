@@ -20,6 +20,7 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint ndisk;        // Number of disks it is striped over
 };
 
 #define FSMAGIC 0x10203040
@@ -50,6 +51,29 @@ struct dinode {
 // Block of free map containing bit for block b
 #define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
 
+// Most distinct blocks that ops may log, for begin_opn().
+#define NBITMAP        (FSSIZE/BPB + 1)    // bitmap blocks
+#define IPUTBLOCKS     (NBITMAP + 1)       // iput() freeing an inode: bitmap, inode
+#define DIRLINKBLOCKS  (NBITMAP + 3)       // dirlink(): entry, indirect, inode, bitmap
+#define CREATEBLOCKS   (DIRLINKBLOCKS + 2) // create(): new inode, its first block, dirlink()
+#ifdef LOG_JOURNALDATA
+// writei() of n bytes at any offset: the blocks they span,
+// bitmap, indirect block and inode.
+#define WRITEBLOCKS(n) (((n)+BSIZE-1)/BSIZE + 1 + NBITMAP + 2)
+#define WRITEMAX       ((MAXOPBLOCKS-1-NBITMAP-2) * BSIZE)  // bytes per op
+#else
+// ordered mode: writei() of a file logs only bitmap, indirect
+// block and inode; the data goes to its home location.
+#define WRITEBLOCKS(n) (NBITMAP + 2)
+#define WRITEMAX       (4*MAXSEG*BSIZE)  // bytes per op
+#endif
+
+// With the file system striped over n disks (RAID-0), block b is
+// block STRIPEBLOCK(b, n) of disk STRIPEDISK(b, n): blocks are
+// dealt out to the disks STRIPE at a time.
+#define STRIPEDISK(b, n)  (((b) / STRIPE) % (n))
+#define STRIPEBLOCK(b, n) ((b) / STRIPE / (n) * STRIPE + (b) % STRIPE)
+
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
 
@@ -1,6 +1,32 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous runs of 2^order pages.
+//
+// Free memory is managed by a binary buddy allocator: a free
+// block of 2^k pages starts at a page index that is a multiple
+// of 2^k, and freeing a block merges it with its buddy (the
+// other half of the enclosing 2^(k+1) block) whenever the buddy
+// is free too.
+//
+// Single pages are the common case, so each CPU also keeps a
+// private cache of free pages in front of the buddy allocator,
+// and kalloc() and kfree() normally only take that CPU's lock.
+// Pages move between a CPU cache and the buddy allocator KBATCH
+// at a time: an empty cache refills with one 2^KBATCHORDER block
+// (or, failing that, single pages, or pages stolen from another
+// CPU), and a cache that grows past KHIGH spills a batch back.
+//
+// Memory is handed to the buddy allocator lazily: at boot every
+// page above the kernel is "untouched", and buddy_alloc() carves
+// the next block off the untouched region only when its lists
+// cannot satisfy a request. So boot no longer writes all of RAM.
+//
+// Finally, a kernel thread keeps a pool of up to NZERO pages
+// that are already zeroed, for kalloc_zeroed(). The thread
+// zeroes one page each time it is scheduled, so the work is
+// done when CPUs would otherwise be idle rather than in fork,
+// sbrk, or a page fault.
 
 #include "types.h"
 #include "param.h"
@@ -9,44 +35,296 @@
 #include "riscv.h"
 #include "defs.h"
 
-void freerange(void *pa_start, void *pa_end);
+#define KBATCHORDER 5                     // log2 of pages per refill
+#define KBATCH      (1 << KBATCHORDER)    // pages moved per refill or spill
+#define KHIGH       (2*KBATCH)            // spill when a cache grows past this
+#define NZERO       64                    // pre-zeroed pages to keep ready
+
+#define NPAGE       ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2IDX(pa)  (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define IDX2PA(i)   ((void*)(KERNBASE + (uint64)(i) * PGSIZE))
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+// a free block; buddy lists are doubly linked so that a
+// buddy can be unlinked when it merges.
 struct run {
   struct run *next;
+  struct run *prev;
 };
 
+// per-CPU cache of free pages.
+struct kmem {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+
+  // statistics, protected by lock.
+  int nrefill;  // refills from the buddy allocator
+  int nspill;   // batches spilled to the buddy allocator
+  int nsteal;   // refills taken from another CPU
+};
+
+struct kmem kmem[NCPU];
+
+// the buddy allocator, shared by all CPUs.
+struct {
+  struct spinlock lock;
+  struct run free[MAXORDER+1]; // list heads, one per order
+  int nblock[MAXORDER+1];      // blocks on each list
+  int nfree;                   // free pages in all lists
+  uint64 untouched;            // pages from here to NPAGE are free
+                               // but not yet on any list
+
+  // order+1 if page i heads a free block on free[order],
+  // 0 if it is allocated, cached by a CPU, or inside a block.
+  uchar order[NPAGE];
+} kpool;
+
+// pages zeroed ahead of time by kzeroer().
 struct {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int n;
+  struct proc *thread;  // kzeroer()
+  int idle;             // kzeroer() is asleep; wake it when n drops
+
+  // statistics, protected by lock.
+  int nhit;      // kalloc_zeroed() served from the pool
+  int nmiss;     // kalloc_zeroed() had to zero inline
+  int nreclaim;  // pages taken back by kalloc()
+} kzero;
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&kpool.lock, "kpool");
+  initlock(&kzero.lock, "kzero");
+  for(int k = 0; k <= MAXORDER; k++)
+    kpool.free[k].next = kpool.free[k].prev = &kpool.free[k];
+  kpool.untouched = PA2IDX(PGROUNDUP((uint64)end));
 }
 
-void
-freerange(void *pa_start, void *pa_end)
+// Buddy lists. Caller must hold kpool.lock.
+
+static void
+push(int k, uint64 i)
+{
+  struct run *r = (struct run*)IDX2PA(i);
+
+  r->next = kpool.free[k].next;
+  r->prev = &kpool.free[k];
+  r->next->prev = r;
+  kpool.free[k].next = r;
+  kpool.order[i] = k + 1;
+  kpool.nblock[k]++;
+  kpool.nfree += 1 << k;
+}
+
+static void
+unlink(int k, uint64 i)
+{
+  struct run *r = (struct run*)IDX2PA(i);
+
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  kpool.order[i] = 0;
+  kpool.nblock[k]--;
+  kpool.nfree -= 1 << k;
+}
+
+static void buddy_free(void *pa, int order);
+
+// Move the largest aligned block at the start of the untouched
+// region onto the buddy lists. Returns 0 if nothing is left.
+static int
+carve(void)
+{
+  uint64 i = kpool.untouched;
+  int k;
+
+  if(i >= NPAGE)
+    return 0;
+  for(k = MAXORDER; k > 0; k--)
+    if(i % (1 << k) == 0 && i + (1 << k) <= NPAGE)
+      break;
+  kpool.untouched += 1 << k;
+  buddy_free(IDX2PA(i), k);
+  return 1;
+}
+
+// Take a block of 2^order pages, splitting a larger one
+// if necessary. Returns 0 if there is none.
+static void*
+buddy_alloc(int order)
+{
+  struct run *r;
+  uint64 i;
+  int k;
+
+  for(;;){
+    for(k = order; k <= MAXORDER; k++)
+      if(kpool.free[k].next != &kpool.free[k])
+        break;
+    if(k <= MAXORDER)
+      break;
+    if(!carve())
+      return 0;
+  }
+
+  r = kpool.free[k].next;
+  i = PA2IDX(r);
+  unlink(k, i);
+  // give back the upper halves until the block is the right size.
+  while(k > order){
+    k--;
+    push(k, i + (1 << k));
+  }
+  return (void*)r;
+}
+
+// Return a block of 2^order pages, merging it with its
+// buddy for as long as the buddy is free.
+static void
+buddy_free(void *pa, int order)
+{
+  uint64 i, b;
+
+  i = PA2IDX(pa);
+  while(order < MAXORDER){
+    b = i ^ (1 << order);
+    if(b >= NPAGE || kpool.order[b] != order + 1)
+      break;
+    unlink(order, b);
+    if(b < i)
+      i = b;
+    order++;
+  }
+  push(order, i);
+}
+
+// Detach up to n pages from the front of a CPU's *list.
+// Returns the detached chain and its length in *np.
+static struct run*
+takebatch(struct run **list, int n, int *np)
+{
+  struct run *head, *r;
+  int i;
+
+  head = *list;
+  if(head == 0){
+    *np = 0;
+    return 0;
+  }
+  r = head;
+  for(i = 1; i < n && r->next; i++)
+    r = r->next;
+  *list = r->next;
+  r->next = 0;
+  *np = i;
+  return head;
+}
+
+// Give a chain of cached pages back to the buddy allocator.
+static void
+spill(struct run *chain)
 {
+  struct run *r;
+
+  acquire(&kpool.lock);
+  while((r = chain) != 0){
+    chain = r->next;
+    buddy_free(r, 0);
+  }
+  release(&kpool.lock);
+}
+
+// Find a batch of free pages for CPU id, whose cache is empty:
+// first from the buddy allocator, then from the fullest other
+// CPU. Sets *stolen if the batch came from another CPU.
+// Caller must have interrupts off and hold no kmem locks.
+static struct run*
+refill(int id, int *np, int *stolen)
+{
+  struct run *chain, *r;
   char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  int i, victim, most;
+
+  *stolen = 0;
+  *np = 0;
+  chain = 0;
+  acquire(&kpool.lock);
+  if((p = buddy_alloc(KBATCHORDER)) != 0){
+    // carve one contiguous block into single pages.
+    for(i = KBATCH - 1; i >= 0; i--){
+      r = (struct run*)(p + i*PGSIZE);
+      r->next = chain;
+      chain = r;
+    }
+    *np = KBATCH;
+  } else {
+    while(*np < KBATCH && (r = buddy_alloc(0)) != 0){
+      r->next = chain;
+      chain = r;
+      (*np)++;
+    }
+  }
+  release(&kpool.lock);
+  if(chain)
+    return chain;
+
+  // the buddy allocator is dry; steal half of the fullest
+  // CPU's cache. nfree is read without the lock, so it is
+  // only a hint.
+  victim = -1;
+  most = 0;
+  for(i = 0; i < NCPU; i++){
+    if(i != id && kmem[i].nfree > most){
+      most = kmem[i].nfree;
+      victim = i;
+    }
+  }
+  if(victim < 0)
+    return 0;
+
+  acquire(&kmem[victim].lock);
+  chain = takebatch(&kmem[victim].freelist, (kmem[victim].nfree+1)/2, np);
+  kmem[victim].nfree -= *np;
+  release(&kmem[victim].lock);
+  *stolen = chain != 0;
+  return chain;
+}
+
+// Return every CPU's cached pages to the buddy allocator,
+// so that they can coalesce into larger blocks.
+static void
+drain(void)
+{
+  struct run *chain;
+
+  for(int i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    chain = kmem[i].freelist;
+    kmem[i].freelist = 0;
+    kmem[i].nfree = 0;
+    release(&kmem[i].lock);
+    if(chain)
+      spill(chain);
+  }
 }
 
 // Free the page of physical memory pointed at by pa,
 // which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to kalloc().
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *chain;
+  struct kmem *km;
+  int n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
@@ -56,10 +334,65 @@ kfree(void *pa)
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  km = &kmem[cpuid()];
+  chain = 0;
+  acquire(&km->lock);
+  r->next = km->freelist;
+  km->freelist = r;
+  km->nfree++;
+  if(km->nfree > KHIGH){
+    chain = takebatch(&km->freelist, KBATCH, &n);
+    km->nfree -= n;
+    km->nspill++;
+  }
+  release(&km->lock);
+  if(chain)
+    spill(chain);
+  pop_off();
+}
+
+// Take one page from this CPU's cache, refilling it if
+// necessary. Returns 0 if there is none.
+static struct run*
+allocpage(void)
+{
+  struct run *r, *chain;
+  struct kmem *km;
+  int id, n, stolen;
+
+  push_off();
+  id = cpuid();
+  km = &kmem[id];
+
+  acquire(&km->lock);
+  r = km->freelist;
+  if(r){
+    km->freelist = r->next;
+    km->nfree--;
+  }
+  release(&km->lock);
+
+  if(r == 0 && (chain = refill(id, &n, &stolen)) != 0){
+    r = chain;
+    acquire(&km->lock);
+    if(r->next){
+      // r->next..end of chain joins this CPU's cache.
+      struct run *t;
+      for(t = r->next; t->next; t = t->next)
+        ;
+      t->next = km->freelist;
+      km->freelist = r->next;
+      km->nfree += n - 1;
+    }
+    if(stolen)
+      km->nsteal++;
+    else
+      km->nrefill++;
+    release(&km->lock);
+  }
+  pop_off();
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -70,13 +403,199 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  if((r = allocpage()) == 0){
+    // take back pages from the zeroed pool,
+    // and then from the buffer and inode caches.
+    acquire(&kzero.lock);
+    if((r = kzero.freelist) != 0){
+      kzero.freelist = r->next;
+      kzero.n--;
+      kzero.nreclaim++;
+    }
+    release(&kzero.lock);
+    if(r == 0 && bshrink() + ishrink() > 0)
+      r = allocpage();
+  }
 
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
   return (void*)r;
 }
+
+// Return roughly how many pages are free, counting CPU caches,
+// the zeroed pool, and untouched memory. Read without locks,
+// so only a hint.
+int
+kfreepages(void)
+{
+  int i, n;
+
+  n = kpool.nfree + (NPAGE - kpool.untouched) + kzero.n;
+  for(i = 0; i < NCPU; i++)
+    n += kmem[i].nfree;
+  return n;
+}
+
+// Allocate one zeroed page, from the pre-zeroed pool if
+// possible. Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+  int wake;
+
+  acquire(&kzero.lock);
+  if((r = kzero.freelist) != 0){
+    kzero.freelist = r->next;
+    kzero.n--;
+    kzero.nhit++;
+  } else {
+    kzero.nmiss++;
+  }
+  wake = kzero.idle;
+  kzero.idle = 0;
+  release(&kzero.lock);
+  if(wake && kzero.thread)
+    wakeupproc(kzero.thread, &kzero);
+
+  if(r){
+    r->next = 0;  // the only non-zero word
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
+  return (void*)r;
+}
+
+// Body of the kernel thread that keeps the zeroed pool full.
+// It sleeps while the pool is full, or memory has run out, until
+// kalloc_zeroed() takes a page. kalloc_zeroed()'s callers may
+// hold a process's lock, so it wakes the thread with wakeupproc().
+static void
+kzeroer(void)
+{
+  struct run *r;
+
+  for(;;){
+    acquire(&kzero.lock);
+    while(kzero.n >= NZERO){
+      kzero.idle = 1;
+      sleep(&kzero, &kzero.lock);
+    }
+    release(&kzero.lock);
+
+    // not kalloc(), which would take back pages from the pool.
+    if((r = allocpage()) == 0){
+      acquire(&kzero.lock);
+      kzero.idle = 1;
+      sleep(&kzero, &kzero.lock);
+      release(&kzero.lock);
+      continue;
+    }
+    memset((char*)r, 0, PGSIZE);
+
+    acquire(&kzero.lock);
+    r->next = kzero.freelist;
+    kzero.freelist = r;
+    kzero.n++;
+    release(&kzero.lock);
+
+    // one page at a time, so that runnable processes come first.
+    yield();
+  }
+}
+
+// Start the page-zeroing thread.
+void
+kzeroinit(void)
+{
+  kzero.thread = kthread(kzeroer, "kzero");
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size. Returns 0 if no such block is free.
+void *
+kalloc_order(int order)
+{
+  void *pa;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kalloc_order");
+  if(order == 0)
+    return kalloc();
+
+  acquire(&kpool.lock);
+  pa = buddy_alloc(order);
+  release(&kpool.lock);
+  if(pa == 0){
+    // the pages may be sitting in the CPU caches.
+    drain();
+    acquire(&kpool.lock);
+    pa = buddy_alloc(order);
+    release(&kpool.lock);
+  }
+
+  if(pa)
+    memset(pa, 5, PGSIZE << order); // fill with junk
+  return pa;
+}
+
+// Free a block returned by kalloc_order(order).
+void
+kfree_order(void *pa, int order)
+{
+  if(order < 0 || order > MAXORDER)
+    panic("kfree_order");
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(((uint64)pa % (PGSIZE << order)) != 0 || (char*)pa < end ||
+     (uint64)pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_order");
+
+  memset(pa, 1, PGSIZE << order);
+
+  acquire(&kpool.lock);
+  buddy_free(pa, order);
+  release(&kpool.lock);
+}
+
+// Report per-CPU cache and buddy list state, lock contention,
+// and external fragmentation for the statistics device.
+//
+// For each order k, frag is the percentage of free pages that
+// are in blocks too small to satisfy a 2^k-page request
+// (0 = all free memory usable at that order).
+int
+kallocstats(char *buf, int sz)
+{
+  int i, k, n, small;
+
+  n = 0;
+  for(i = 0; i < NCPU; i++){
+    struct kmem *km = &kmem[i];
+    if(km->lock.n == 0)
+      continue;
+    n += snprintf(buf+n, sz-n,
+                  "kmem %d: free %d refill %d spill %d steal %d "
+                  "#acquire %d #test-and-set %d\n",
+                  i, km->nfree, km->nrefill, km->nspill, km->nsteal,
+                  km->lock.n, km->lock.nts);
+  }
+  n += snprintf(buf+n, sz-n,
+                "kpool: free %d untouched %d #acquire %d #test-and-set %d\n",
+                kpool.nfree, (int)(NPAGE - kpool.untouched),
+                kpool.lock.n, kpool.lock.nts);
+  n += snprintf(buf+n, sz-n, "kzero: pool %d hit %d miss %d reclaim %d\n",
+                kzero.n, kzero.nhit, kzero.nmiss, kzero.nreclaim);
+
+  small = 0;
+  for(k = 0; k <= MAXORDER; k++){
+    n += snprintf(buf+n, sz-n, "kpool order %d: blocks %d frag %d%%\n",
+                  k, kpool.nblock[k],
+                  kpool.nfree ? (int)((uint64)small * 100 / kpool.nfree) : 0);
+    small += kpool.nblock[k] << k;
+  }
+  return n;
+}
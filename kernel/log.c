@@ -2,10 +2,12 @@
 #include "riscv.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "proc.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
@@ -19,7 +21,56 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the last outstanding end_op() makes room.
+//
+// begin_op() reserves log space for the most blocks any op
+// writes, MAXOPBLOCKS; begin_opn(n) reserves n, the most the
+// caller's op can write (see the *BLOCKS macros in fs.h). Each
+// block log_write() adds to the transaction uses one block of
+// the reservation, and end_op() returns what is left of it.
+//
+// Commits are grouped: end_op() does not commit just because
+// it is the last outstanding op, so a transaction collects the
+// updates of many system calls. It commits when it fills a
+// quarter of the log (the last end_op() then commits it), or
+// else when its first update is COMMITTICKS old (the logger
+// thread closes it to new ops and commits once the running
+// ones end). A system call's updates are thus durable within a
+// few ticks, not by the time it returns. A process that needs
+// them durable sooner calls fsync() or fdatasync(), which commit
+// up to a given transaction with log_sync(); or the log is put in
+// sync mode ("log sync" to the statistics device), where each
+// end_op() waits for its transaction to commit, and the last
+// op to end commits it at once, as xv6 originally did.
+//
+// Transactions are numbered: log.seq is the open one's number,
+// and log.done that of the newest durable one.
+//
+// A transaction is closed to new ops only until its blocks are
+// copied into log buffers. The copies are the committing
+// transaction's own snapshot, so the next transaction opens
+// while they are written and may modify the same blocks in the
+// cache; only one transaction commits at a time.
+//
+// Committing only appends the transaction to the log. Committed
+// transactions stay in the log, their blocks pinned in the cache,
+// until a checkpoint installs them all at their home locations,
+// each distinct block once and in block order, and empties the
+// log. The logger checkpoints when committed transactions fill
+// half the log, or when the file system is idle; begin_op() and
+// end_op() checkpoint only if the log is full.
+//
+// The log's size is set by mkfs (-l) in the superblock, up to
+// LOGSIZE data blocks plus the header.
+//
+// Unless the kernel is built with JOURNALDATA=1, file data is not
+// logged (ordered mode, see writei()): it is written in place
+// before the op ends, so before the transaction that points to it
+// commits. For that to be safe, log_pending() tells balloc() which
+// blocks must not be written in place yet: those with a copy in
+// the log, which recovery or a checkpoint would write back over
+// them, and those freed by a transaction that has not committed,
+// which a crash would give back to their old owner.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,7 +79,22 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// where the committed transactions follow each other, and a
+// block may appear more than once; the last copy is the newest.
+// write_log() and install_trans() start all of their writes with
+// bwritev_async() before waiting for any of them, so the device
+// has them queued at once; the log blocks are consecutive, so
+// they go out in a few large requests, and the block queue merges
+// install_trans()'s adjacent home locations.
+// commit() waits for all log blocks before writing the header;
+// that is the only point where it waits. The disk may hold
+// finished writes in a volatile cache, so write_head() flushes it
+// (blk_flush()) before and after the header goes out: before, so
+// the header never reaches the disk ahead of what it names, and
+// after, so the commit is durable when it returns. It reads nothing from
+// disk: log blocks are overwritten whole (bnew()), and the home
+// locations are installed from the cached, pinned blocks. Only
+// recovery reads the log, MAXSEG blocks per request.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -37,49 +103,143 @@ struct logheader {
   int block[LOGSIZE];
 };
 
+// a distinct block of the committed transactions, for install_trans().
+struct ckblock {
+  int block;
+  int pos;         // index of its newest copy in the log
+  int n;           // copies in the log
+};
+
 struct log {
   struct spinlock lock;
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // their unused reservations
+  int committing;  // in commit() or checkpoint()
+  int closing;     // the open transaction takes no new ops; please wait.
+  int nwait;       // begin_op()s waiting for log space
+  int sync;        // end_op() waits for its transaction to commit
+  uint seq;        // number of the open transaction
+  uint done;       // newest durable transaction
+  uint first;      // ticks at the transaction's first log_write()
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // committed transactions, as on disk
+  struct logheader tx;  // the open transaction
+  uchar freed[2][FSSIZE/8+1]; // blocks freed by the open and the committing transaction
+  int curfree;          // the open transaction's freed[]
+  struct buf *bufs[LOGSIZE]; // commit()'s, off the kernel stack
+  struct ckblock ck[LOGSIZE];
+
+  // commit latency, in CLINT_MTIME cycles; updated only by
+  // the committing process.
+  int ncommit;
+  uint64 commitsum;
+  uint64 commitmax;
+
+  // protected by lock.
+  int nop;         // ops ended
+  int nblock;      // blocks committed
+  int ntimer;      // commits by the logger thread
+  int nsync;       // commits by log_sync()
+  int nckpt;       // checkpoints
+  int ninstall;    // blocks installed by checkpoints
+  int nreserve;    // blocks reserved by ended ops
+  int nused;       // blocks logged by ended ops
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void commit(int);
+static void checkpoint();
+static void logger(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
+  if (sb->nlog - 1 > LOGSIZE)
+    panic("initlog: log bigger than LOGSIZE");
+  if (sb->nlog - 1 < 2*MAXOPBLOCKS)
+    panic("initlog: log too small");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  log.seq = 1;
   recover_from_log();
+  kthread(logger, "logger");
 }
 
-// Copy committed blocks from log to their home location
-static void
+// Fill log.ck[] with the distinct blocks of log.lh, sorted by
+// block number, and return how many there are.
+static int
+sortlog(void)
+{
+  struct ckblock *ck = log.ck;
+  int i, j, n;
+
+  n = 0;
+  for (i = 0; i < log.lh.n; i++) {
+    for (j = n; j > 0 && ck[j-1].block > log.lh.block[i]; j--)
+      ;
+    if (j > 0 && ck[j-1].block == log.lh.block[i]) {
+      ck[j-1].pos = i;
+      ck[j-1].n++;
+      continue;
+    }
+    memmove(&ck[j+1], &ck[j], (n - j) * sizeof(ck[0]));
+    ck[j].block = log.lh.block[i];
+    ck[j].pos = i;
+    ck[j].n = 1;
+    n++;
+  }
+  return n;
+}
+
+// Copy committed blocks from log to their home location, each
+// distinct block once, in block order. Returns how many.
+// After a commit the cache already holds them, pinned, so
+// only recovery needs to read the log.
+static int
 install_trans(int recovering)
 {
-  int tail;
+  struct buf **dbuf = log.bufs;
+  struct buf *lbuf[MAXSEG];
+  int tail, i, j, n, nck;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  nck = sortlog();
+  for (i = 0; i < nck; i++) {
+    if (recovering)
+      dbuf[i] = bnew(log.dev, log.ck[i].block); // dst
+    else
+      dbuf[i] = bread(log.dev, log.ck[i].block); // cached dst
+    dbuf[i]->ioclass = IOC_LOG;
+  }
+  for (tail = 0; recovering && tail < log.lh.n; tail += n) {
+    n = log.lh.n - tail;
+    if (n > MAXSEG)
+      n = MAXSEG;
+    breadv(log.dev, log.start+tail+1, n, lbuf); // read log blocks
+    for (i = 0; i < nck; i++) {
+      j = log.ck[i].pos - tail;
+      if (j >= 0 && j < n)
+        memmove(dbuf[i]->data, lbuf[j]->data, BSIZE);  // copy newest copy to dst
+    }
+    for (j = 0; j < n; j++)
+      brelse(lbuf[j]);
+  }
+  bwritev_async(dbuf, nck);  // start writing dsts to disk
+  for (i = 0; i < nck; i++) {
+    bwait(dbuf[i]);
+    dbuf[i]->ioclass = IOC_DATA;
+    for (j = 0; recovering == 0 && j < log.ck[i].n; j++)
+      bunpin(dbuf[i]);
+    brelse(dbuf[i]);
   }
+  return nck;
 }
 
 // Read the log header from disk into the in-memory log header
@@ -98,18 +258,25 @@ read_head(void)
 
 // Write in-memory log header to disk.
 // This is the true point at which the
-// current transaction commits.
+// transactions it lists commit.
 static void
 write_head(void)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
+  struct buf *buf;
+  struct logheader *hb;
   int i;
+
+  blk_flush();  // what the header names, and installed blocks
+  buf = bnew(log.dev, log.start);
+  hb = (struct logheader *) (buf->data);
   hb->n = log.lh.n;
   for (i = 0; i < log.lh.n; i++) {
     hb->block[i] = log.lh.block[i];
   }
+  buf->ioclass = IOC_LOG;
   bwrite(buf);
+  blk_flush();
+  buf->ioclass = IOC_DATA;
   brelse(buf);
 }
 
@@ -122,89 +289,333 @@ recover_from_log(void)
   write_head(); // clear the log
 }
 
-// called at the start of each FS system call.
+// Commit the open transaction, and then checkpoint if ckpt is
+// set. Caller holds log.lock, has set log.committing and
+// log.closing, and has seen log.outstanding reach 0.
+static void
+docommit(int ckpt)
+{
+  // call commit w/o holding locks, since not allowed
+  // to sleep with locks.
+  release(&log.lock);
+  // a checkpoint installs from the cache, so no new op
+  // may dirty it until then.
+  commit(!ckpt);
+  if(ckpt)
+    checkpoint();
+  acquire(&log.lock);
+  log.closing = 0;
+  log.committing = 0;
+  wakeup(&log);
+  if(log.lh.n > 0)
+    wakeup(&log.tx);  // the logger checkpoints it
+}
+
+// called at the start of each FS system call that logs at
+// most nblocks distinct blocks.
 void
-begin_op(void)
+begin_opn(int nblocks)
 {
+  struct proc *p = myproc();
+
+  if(nblocks < 1 || nblocks > MAXOPBLOCKS)
+    panic("begin_opn");
+  // a nested op would overwrite p->logres, leaking the outer
+  // op's reservation, and could wait for a commit that waits
+  // for the outer op to end.
+  if(p->inop)
+    panic("begin_opn: nested op");
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
-      sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    if(log.closing){
       sleep(&log, &log.lock);
+    } else if(log.lh.n + log.tx.n + log.reserved + nblocks > log.size - 1){
+      // this op might exhaust log space; wait for a checkpoint,
+      // or do one now if no op or commit is left to do it.
+      if(log.outstanding == 0 && !log.committing){
+        log.committing = log.closing = 1;
+        docommit(1);
+      } else {
+        log.nwait++;
+        sleep(&log, &log.lock);
+        log.nwait--;
+      }
     } else {
       log.outstanding += 1;
+      log.reserved += nblocks;
+      log.nreserve += nblocks;
+      p->inop = 1;
+      p->logres = nblocks;
       release(&log.lock);
       break;
     }
   }
 }
 
+// called at the start of each FS system call.
+void
+begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation and the
+// transaction is a quarter of the log, and checkpoints too if
+// ops are waiting for space. In sync mode, waits for the
+// transaction to commit.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  struct proc *p = myproc();
+  uint seq;
+
+  if(!p->inop)
+    panic("end_op: not in an op");
+  p->inop = 0;
 
   acquire(&log.lock);
+  seq = log.seq;  // cannot close while this op runs
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+  log.reserved -= p->logres;  // return the unused part
+  p->logres = 0;
+  log.nop++;
+  if(log.outstanding == 0 && !log.committing &&
+     (log.nwait > 0 || log.tx.n >= (log.size - 1) / 4)){
+    log.committing = log.closing = 1;
+    docommit(log.nwait > 0);
   } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+    // begin_op() may be waiting for log space, and
+    // returning this op's reservation has made some;
+    // or the logger may be
+    // waiting for the last outstanding op to end.
     wakeup(&log);
   }
   release(&log.lock);
+  if(log.sync)
+    log_sync(seq);
+}
+
+// The number of the open transaction. In an op, the one the
+// op's updates belong to.
+uint
+log_seq(void)
+{
+  uint seq;
+
+  acquire(&log.lock);
+  seq = log.seq;
+  release(&log.lock);
+  return seq;
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Wait until transaction seq and those before it are durable,
+// committing the open one if it is seq, without waiting for
+// the logger. Caller must not be in an op.
+// Returns 1 if this call committed seq, and so flushed the
+// disk's cache after everything the caller wrote before it.
+int
+log_sync(uint seq)
+{
+  int committed = 0;
+
+  if(myproc()->inop)
+    panic("log_sync: in an op");
+
+  acquire(&log.lock);
+  while(log.done < seq){
+    if(seq == log.seq && log.tx.n == 0 && log.done + 1 == seq)
+      break;  // nothing in it, and the rest is durable
+    if(seq != log.seq || log.committing ||
+       (log.sync && log.outstanding > 0)){
+      // wait for the running commit, or in sync mode for
+      // the last op, which commits when it ends.
+      sleep(&log, &log.lock);
+      continue;
+    }
+    log.committing = log.closing = 1;
+    while(log.outstanding > 0)
+      sleep(&log, &log.lock);
+    log.nsync++;
+    docommit(log.nwait > 0);
+    committed = 1;
   }
+  release(&log.lock);
+  return committed;
+}
+
+// Turn sync mode on or off. In sync mode every end_op() waits
+// until its transaction has committed, so a system call's
+// updates are durable when it returns, at the cost of a commit
+// (and two disk cache flushes) per call instead of per group.
+// Off (relaxed, the default), updates become durable within
+// a few ticks, or at fsync()/fdatasync(). Set by writing
+// "log sync" or "log relaxed" to the statistics device.
+void
+log_setsync(int on)
+{
+  acquire(&log.lock);
+  log.sync = on;
+  wakeup(&log);
+  release(&log.lock);
 }
 
-// Copy modified blocks from cache to log.
+// Body of the kernel thread that commits transactions whose first
+// update is COMMITTICKS old, and checkpoints when committed ones
+// fill half the log or no op is running. While there is a
+// transaction or a committed one in the log, it looks once per
+// tick; otherwise it sleeps on &log.tx until log_write() starts a
+// transaction or docommit() leaves one to checkpoint.
 static void
-write_log(void)
+logger(void)
+{
+  int ckpt;
+
+  acquire(&log.lock);
+  for(;;){
+    if(log.tx.n == 0 && log.lh.n == 0)
+      sleep(&log.tx, &log.lock);
+    else
+      sleep(&ticks, &log.lock);
+    if(log.committing)
+      continue;
+    ckpt = log.lh.n >= (log.size - 1) / 2 ||
+           (log.lh.n > 0 && log.tx.n == 0 && log.outstanding == 0);
+    if(!ckpt && (log.tx.n == 0 || ticks - log.first < COMMITTICKS))
+      continue;
+    // close the transaction to new ops, and wait for
+    // the running ones to end.
+    log.committing = log.closing = 1;
+    while(log.outstanding > 0)
+      sleep(&log, &log.lock);
+    if(log.tx.n > 0)
+      log.ntimer++;
+    docommit(ckpt);
+  }
+}
+
+// Copy the open transaction's blocks from cache to log, after
+// the committed ones, and move them to log.lh. If reopen is set,
+// new ops may start once the copies are made, while they are
+// written. Returns the transaction's number.
+static uint
+write_log(int reopen)
 {
-  int tail;
+  struct buf **to = log.bufs;
+  int tail, n;
+  uint seq;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+  n = log.tx.n;
+  for (tail = 0; tail < n; tail++) {
+    to[tail] = bnew(log.dev, log.start+log.lh.n+tail+1); // log block
+    struct buf *from = bread(log.dev, log.tx.block[tail]); // cache block
+    memmove(to[tail]->data, from->data, BSIZE);
+    to[tail]->ioclass = IOC_LOG;
     brelse(from);
-    brelse(to);
   }
+  memmove(&log.lh.block[log.lh.n], log.tx.block, n * sizeof(int));
+  acquire(&log.lock);
+  log.lh.n += n;
+  log.tx.n = 0;
+  seq = log.seq++;
+  log.curfree ^= 1;  // its frees commit with it
+  log.nblock += n;
+  if(reopen){
+    log.closing = 0;
+    wakeup(&log);
+  }
+  release(&log.lock);
+
+  bwritev_async(to, n);  // start writing the log
+  for (tail = 0; tail < n; tail++) {
+    bwait(to[tail]);
+    to[tail]->ioclass = IOC_DATA;
+    brelse(to[tail]);
+  }
+  return seq;
 }
 
 static void
-commit()
+commit(int reopen)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
+  uint64 t;
+  uint seq;
+
+  if (log.tx.n > 0) {
+    t = r_time();
+    seq = write_log(reopen); // Write modified blocks from cache to log
     write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+    acquire(&log.lock);
+    memset(log.freed[log.curfree^1], 0, sizeof(log.freed[0]));
+    log.done = seq;
+    wakeup(&log);
+    release(&log.lock);
+    t = r_time() - t;
+    log.ncommit++;
+    log.commitsum += t;
+    if(t > log.commitmax)
+      log.commitmax = t;
+  }
+}
+
+// Install the committed transactions and empty the log.
+// Caller has committed the open transaction, and no op is running.
+static void
+checkpoint()
+{
+  int n;
+
+  if (log.lh.n > 0) {
+    n = install_trans(0); // Install writes to home locations
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    write_head();    // Erase the transactions from the log
+    acquire(&log.lock);
+    log.nckpt++;
+    log.ninstall += n;
+    release(&log.lock);
   }
 }
 
+// Report commit count, latency and grouping for the statistics
+// device. timer is how many commits the logger thread made,
+// and synced how many log_sync() made;
+// installed is the distinct blocks written by checkpoints;
+// reserved/op and used/op are in tenths of a block.
+int
+logstats(char *buf, int sz)
+{
+  int us = TIMEBASE / 1000000;
+  int nc, nop, nblock, ntimer, nsync, nckpt, ninstall, nreserve, nused;
+
+  acquire(&log.lock);
+  nc = log.ncommit;
+  nop = log.nop;
+  nblock = log.nblock;
+  ntimer = log.ntimer;
+  nsync = log.nsync;
+  nckpt = log.nckpt;
+  ninstall = log.ninstall;
+  nreserve = log.nreserve;
+  nused = log.nused;
+  release(&log.lock);
+  return snprintf(buf, sz,
+                  "log: size %d commits %d avg-us %d max-us %d "
+                  "ops/commit %d blocks/commit %d timer %d synced %d "
+                  "checkpoints %d installed %d "
+                  "reserved/op %d used/op %d\n",
+                  log.size - 1, nc,
+                  nc ? (int)(log.commitsum / nc / us) : 0,
+                  (int)(log.commitmax / us),
+                  nc ? nop / nc : 0, nc ? nblock / nc : 0, ntimer, nsync,
+                  nckpt, ninstall,
+                  nop ? nreserve * 10 / nop : 0, nop ? nused * 10 / nop : 0);
+}
+
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// commit()/write_log() will do the disk write, and a checkpoint
+// will unpin it.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -214,23 +625,59 @@ commit()
 void
 log_write(struct buf *b)
 {
+  struct proc *p = myproc();
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n + log.tx.n >= log.size - 1)
     panic("too big a transaction");
-  if (log.outstanding < 1)
+  if (log.outstanding < 1 || !p->inop)
     panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorption
+  for (i = 0; i < log.tx.n; i++) {
+    if (log.tx.block[i] == b->blockno)   // log absorption
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  log.tx.block[i] = b->blockno;
+  if (i == log.tx.n) {  // Add new block to log?
+    if (p->logres < 1)
+      panic("log_write: op exceeded its reservation");
+    p->logres--;
+    log.reserved--;
+    log.nused++;
     bpin(b);
-    log.lh.n++;
+    if (log.tx.n == 0){
+      log.first = ticks;
+      wakeup(&log.tx);  // the logger times it
+    }
+    log.tx.n++;
   }
   release(&log.lock);
 }
 
+// Record that the running op frees block b.
+void
+log_free(uint b)
+{
+  acquire(&log.lock);
+  log.freed[log.curfree][b/8] |= 1 << (b%8);
+  release(&log.lock);
+}
+
+// Must block b, which is free, not be written in place yet?
+// True if the log holds a copy of it, committed or not, or a
+// transaction that frees it has not committed.
+int
+log_pending(uint b)
+{
+  int i, r;
+
+  acquire(&log.lock);
+  r = (log.freed[0][b/8] | log.freed[1][b/8]) & (1 << (b%8));
+  for (i = 0; !r && i < log.lh.n; i++)
+    r = log.lh.block[i] == b;
+  for (i = 0; !r && i < log.tx.n; i++)
+    r = log.tx.block[i] == b;
+  release(&log.lock);
+  return r != 0;
+}
@@ -17,6 +17,7 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    slabinit();      // small-object caches
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
@@ -27,8 +28,16 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    statsinit();     // statistics device
+#ifdef BLK_RAMDISK
+    ramdiskinit();   // file system image loaded by qemu -initrd
+#else
     virtio_disk_init(); // emulated hard disk
+#endif
+    blkinit();       // block request queues
     userinit();      // first user process
+    kzeroinit();     // page-zeroing kernel thread
     __sync_synchronize();
     started = 1;
   } else {
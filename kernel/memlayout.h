@@ -8,6 +8,7 @@
 // 0C000000 -- PLIC
 // 10000000 -- uart0 
 // 10001000 -- virtio disk 
+// 10002000 -- more virtio-mmio slots, one page each
 // 80000000 -- boot ROM jumps here in machine mode
 //             -kernel loads the kernel here
 // unused RAM after 80000000.
@@ -16,19 +17,24 @@
 // 80000000 -- entry.S, then kernel text and data
 // end -- start of kernel page allocation area
 // PHYSTOP -- end RAM used by the kernel
+// RAMDISK -- fs.img, when built with RAMDISK=1
 
 // qemu puts UART registers here in physical memory.
 #define UART0 0x10000000L
 #define UART0_IRQ 10
 
-// virtio mmio interface
+// virtio mmio interface; qemu's virt machine has NVIRTIO slots,
+// and slot i interrupts on VIRTIO0_IRQ+i.
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
+#define NVIRTIO 8
+#define VIRTIO(i) (VIRTIO0 + (i)*0x1000)
 
 // core local interruptor (CLINT), which contains the timer.
 #define CLINT 0x2000000L
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
+#define TIMEBASE 10000000            // CLINT_MTIME cycles per second.
 
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
@@ -42,7 +48,14 @@
 // for use by the kernel and user pages
 // from physical address 0x80000000 to PHYSTOP.
 #define KERNBASE 0x80000000L
+#ifdef BLK_RAMDISK
+// qemu -initrd loads fs.img halfway into RAM (on machines with
+// less than 256MB), so the kernel stops short of it.
+#define RAMDISK (KERNBASE + 64*1024*1024)
+#define PHYSTOP RAMDISK
+#else
 #define PHYSTOP (KERNBASE + 128*1024*1024)
+#endif
 
 // map the trampoline page to the highest address,
 // in both user and kernel space.
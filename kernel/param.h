@@ -1,14 +1,21 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
-#define NVMA         16  // maximum number of virtual memory areas
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // minimum number of active i-nodes (usertests)
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define LOGSIZE      254  // max data blocks in on-disk log (header fits a block)
+#define LOGBLOCKS    128  // default on-disk log, header included (mkfs -l)
+#define COMMITTICKS  1    // commit a transaction this many ticks after its first write
+#define NBUF         (LOGSIZE+MAXOPBLOCKS*3)  // minimum size of disk block cache
+#define NBUFMAX      4096  // maximum size of disk block cache
+#define MAXSEG       16    // max blocks in one disk request
+#define NDISK        4     // maximum disks striped together (RAID-0)
+#define STRIPE       16    // blocks per disk per stripe
+#define RAMIN        4     // initial readahead window, in blocks
+#define RAMAX        64    // maximum readahead window, in blocks
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define MAXORDER     10    // largest kalloc_order() block is 2^MAXORDER pages
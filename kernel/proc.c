@@ -12,16 +12,13 @@ struct proc proc[NPROC];
 
 struct proc *initproc;
 
-struct {
-  struct vma _vma[NVMA];
-  struct vma *free_vma_list;
-  struct spinlock lock;
-} vma;
+static struct kmem_cache *vmacache;
 
 int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadret(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
@@ -54,7 +51,6 @@ void
 procinit(void)
 {
   struct proc *p;
-  int i;
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
@@ -63,12 +59,8 @@ procinit(void)
       p->state = UNUSED;
       p->kstack = KSTACK((int) (p - proc));
   }
-  
-  initlock(&vma.lock, "vma");
-  for (i = 0; i < NVMA; ++i) {
-    vma._vma[i].next = vma.free_vma_list;
-    vma.free_vma_list = &vma._vma[i];
-  }
+
+  vmacache = kmem_cache_create("vma", sizeof(struct vma));
 }
 
 // Must be called with interrupts disabled,
@@ -117,47 +109,48 @@ allocpid()
 
 struct vma *
 allocvma(void) {
-  struct vma *v;
-  
-  acquire(&vma.lock);
-  v = vma.free_vma_list;
-  if (v)
-    vma.free_vma_list = v->next;
-  release(&vma.lock);
-
-  return v;
+  return kmem_cache_alloc(vmacache);
 }
 
 void
 freevma(struct vma *v) {
-  acquire(&vma.lock);
-  v->next = vma.free_vma_list;
-  vma.free_vma_list = v;
-  release(&vma.lock);
+  kmem_cache_free(vmacache, v);
 }
 
 // Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// If found, mark it USED, give it an empty kernel context, and
+// return with p->lock held; the caller sets p->context.ra.
+// If there are no free procs, return 0.
 static struct proc*
-allocproc(void)
+procslot(void)
 {
   struct proc *p;
 
   for(p = proc; p < &proc[NPROC]; p++) {
     acquire(&p->lock);
     if(p->state == UNUSED) {
-      goto found;
+      p->state = USED;
+      memset(&p->context, 0, sizeof(p->context));
+      p->context.sp = p->kstack + PGSIZE;
+      return p;
     } else {
       release(&p->lock);
     }
   }
   return 0;
+}
 
-found:
+// Find an UNUSED proc, and initialize state required to run
+// in the kernel and return to user space; return with p->lock held.
+// If there are no free procs, or a memory allocation fails, return 0.
+static struct proc*
+allocproc(void)
+{
+  struct proc *p;
+
+  if((p = procslot()) == 0)
+    return 0;
   p->pid = allocpid();
-  p->state = USED;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -165,6 +158,11 @@ found:
     release(&p->lock);
     return 0;
   }
+#ifdef RVV
+  // vector registers start out zero.
+  memset(VSTATE(p), 0, PGSIZE - VSTATEOFF);
+  p->vcpu = -1;
+#endif
 
   // An empty user page table.
   p->pagetable = proc_pagetable(p);
@@ -174,11 +172,8 @@ found:
     return 0;
   }
 
-  // Set up new context to start executing at forkret,
-  // which returns to user space.
-  memset(&p->context, 0, sizeof(p->context));
+  // Start executing at forkret, which returns to user space.
   p->context.ra = (uint64)forkret;
-  p->context.sp = p->kstack + PGSIZE;
 
   return p;
 }
@@ -203,6 +198,7 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
   p->state = UNUSED;
 }
 
@@ -289,6 +285,25 @@ userinit(void)
   release(&p->lock);
 }
 
+// Start a kernel thread that runs fn(), which must never return.
+// A kernel thread is a process slot with only a kernel stack: no
+// pid, page table, trapframe or parent, and kill() skips it. It
+// sleeps, wakes up, and is scheduled like any other process.
+struct proc*
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = procslot()) == 0)
+    panic("kthread");
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+  return p;
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -352,6 +367,10 @@ fork(void)
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
+#ifdef RVV
+  // usertrap() saved p's vector state if p had changed it.
+  memmove(VSTATE(np), VSTATE(p), PGSIZE - VSTATEOFF);
+#endif
 
   // Cause fork to return 0 in the child.
   np->trapframe->a0 = 0;
@@ -569,6 +588,19 @@ yield(void)
   release(&p->lock);
 }
 
+// CLINT_MTIME when the first process was about to enter user
+// space, for reporting boot time.
+static uint64 initdone;
+
+// Report the time from boot to running init, for the statistics
+// device.
+int
+bootstats(char *buf, int sz)
+{
+  return snprintf(buf, sz, "boot: ms-to-init %d\n",
+                  (int)((initdone - boottime) / (TIMEBASE / 1000)));
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch to forkret.
 void
@@ -585,6 +617,8 @@ forkret(void)
     // be run from main().
     fsinit(ROOTDEV);
 
+    initdone = r_time();
+
     first = 0;
     // ensure other cores see first=0.
     __sync_synchronize();
@@ -593,6 +627,20 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kfn();
+  panic("kthread returned");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
@@ -642,6 +690,19 @@ wakeup(void *chan)
   }
 }
 
+// Wake up p if it is sleeping on chan. Unlike wakeup(), takes
+// only p's lock, so the caller may hold other processes' locks.
+void
+wakeupproc(struct proc *p, void *chan)
+{
+  if(p == myproc())
+    return;
+  acquire(&p->lock);
+  if(p->state == SLEEPING && p->chan == chan)
+    p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Kill the process with the given pid.
 // The victim won't exit until it tries to return
 // to user space (see usertrap() in trap.c).
@@ -652,7 +713,7 @@ kill(int pid)
 
   for(p = proc; p < &proc[NPROC]; p++){
     acquire(&p->lock);
-    if(p->pid == pid){
+    if(p->pid == pid && p->kfn == 0){
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
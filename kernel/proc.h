@@ -24,6 +24,7 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  struct proc *vowner;        // RVV=1: whose vector state the registers hold, or null
 };
 
 extern struct cpu cpus[NCPU];
@@ -79,6 +80,14 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// with RVV=1, the rest of the trapframe page holds the process's
+// vector state while it is not in the registers: vl, vtype,
+// vstart and vcsr, then v0..v31, VSTATESZ(vlenb) bytes, which
+// trapinithart() checks fit. See trap.c.
+#define VSTATEOFF 512
+#define VSTATESZ(vlenb) (4*8 + 32*(vlenb))
+#define VSTATE(p) ((uint64*)((char*)(p)->trapframe + VSTATEOFF))
+
 struct vma {
   uint64 start;
   uint64 end;
@@ -115,4 +124,8 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  int inop;                    // between begin_opn() and end_op()
+  int logres;                  // unused log reservation of its FS op
+  void (*kfn)(void);           // body of a kernel thread, or 0
+  int vcpu;                    // RVV=1: cpu that last loaded or saved its vector state, or -1
 };
@@ -16,6 +16,7 @@ r_mhartid()
 #define MSTATUS_MPP_S (1L << 11)
 #define MSTATUS_MPP_U (0L << 11)
 #define MSTATUS_MIE (1L << 3)    // machine-mode interrupt enable.
+#define MSTATUS_VS_INIT (1L << 9) // vector unit on, registers clean.
 
 static inline uint64
 r_mstatus()
@@ -42,6 +43,14 @@ w_mepc(uint64 x)
 
 // Supervisor Status Register, sstatus
 
+#define SSTATUS_VS (3L << 9)   // vector unit state, 0=Off
+#define SSTATUS_VS_CLEAN (2L << 9)
+#define SSTATUS_VS_DIRTY (3L << 9)
+
+// the kernel is compiled without V, so that gcc never uses the
+// vector registers behind vclobber()'s back; with RVV=1 its own
+// vector instructions are assembled with V enabled by VASM.
+#define VASM(insn) ".option push\n.option arch,+v\n" insn "\n.option pop"
 #define SSTATUS_SPP (1L << 8)  // Previous mode, 1=Supervisor, 0=User
 #define SSTATUS_SPIE (1L << 5) // Supervisor Previous Interrupt Enable
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
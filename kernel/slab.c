@@ -0,0 +1,339 @@
+// Slab allocator for small kernel objects.
+//
+// A kmem_cache hands out fixed-size objects carved from single
+// pages ("slabs") obtained from kalloc(). Each slab begins with a
+// struct slab header followed by as many objects as fit, so an
+// object's slab is found by rounding its address down to a page
+// boundary. Slabs with at least one free object are kept on the
+// cache's partial list; a slab whose objects are all free goes
+// straight back to kfree().
+//
+// In front of the slabs, each CPU has a magazine: a small stack
+// of free objects that kmem_cache_alloc() and kmem_cache_free()
+// use without touching the cache's lock. An empty magazine
+// refills, and a full one flushes, half a magazine at a time.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NKCACHE  16   // maximum number of caches
+#define MAGSIZE  16   // objects per per-CPU magazine
+
+// a free object.
+struct obj {
+  struct obj *next;
+};
+
+// header at the start of each slab page.
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;      // partial list
+  struct slab *prev;
+  int inuse;              // objects not on freelist
+  struct obj *freelist;
+};
+
+#define SLABHDR  ((sizeof(struct slab) + 7) & ~7)
+
+struct magazine {
+  struct spinlock lock;
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  char *name;
+  uint size;              // object size, rounded up to 8 bytes
+  int perslab;            // objects per slab
+
+  struct spinlock lock;   // protects the fields below
+  struct slab partial;    // head of the list of slabs with free objects
+  int nslab;              // slabs allocated
+  int ninuse;             // objects allocated, including those in magazines
+
+  struct magazine mag[NCPU];
+};
+
+static struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NKCACHE];
+  int n;
+} kcaches;
+
+void
+slabinit(void)
+{
+  initlock(&kcaches.lock, "kcaches");
+}
+
+// Create a cache of objects of the given size.
+// Caches are never destroyed.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;
+  if(size < sizeof(struct obj) || size > PGSIZE - SLABHDR)
+    panic("kmem_cache_create: size");
+
+  acquire(&kcaches.lock);
+  if(kcaches.n >= NKCACHE)
+    panic("kmem_cache_create: too many caches");
+  c = &kcaches.cache[kcaches.n++];
+  release(&kcaches.lock);
+
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - SLABHDR) / size;
+  initlock(&c->lock, name);
+  c->partial.next = c->partial.prev = &c->partial;
+  for(int i = 0; i < NCPU; i++)
+    initlock(&c->mag[i].lock, name);
+  return c;
+}
+
+// Take a free object from a partial slab, or return 0.
+// Caller must hold c->lock.
+static struct obj*
+slab_get(struct kmem_cache *c)
+{
+  struct slab *s;
+  struct obj *o;
+
+  s = c->partial.next;
+  if(s == &c->partial)
+    return 0;
+  o = s->freelist;
+  s->freelist = o->next;
+  s->inuse++;
+  c->ninuse++;
+  if(s->inuse == c->perslab){
+    // now full; full slabs are not on any list.
+    s->prev->next = s->next;
+    s->next->prev = s->prev;
+  }
+  return o;
+}
+
+// Return object p to its slab. If that empties the slab,
+// unlink it and push it on *empty for the caller to kfree().
+// Caller must hold c->lock.
+static void
+slab_put(struct kmem_cache *c, void *p, struct slab **empty)
+{
+  struct slab *s;
+  struct obj *o;
+
+  s = (struct slab*)PGROUNDDOWN((uint64)p);
+  if(s->cache != c)
+    panic("kmem_cache_free: wrong cache");
+  o = (struct obj*)p;
+
+  if(s->inuse == c->perslab){
+    // was full; back on the partial list.
+    s->next = c->partial.next;
+    s->prev = &c->partial;
+    c->partial.next->prev = s;
+    c->partial.next = s;
+  }
+  o->next = s->freelist;
+  s->freelist = o;
+  s->inuse--;
+  c->ninuse--;
+  if(s->inuse == 0){
+    s->prev->next = s->next;
+    s->next->prev = s->prev;
+    c->nslab--;
+    s->next = *empty;
+    *empty = s;
+  }
+}
+
+static void
+freeslabs(struct slab *s)
+{
+  struct slab *next;
+
+  for(; s; s = next){
+    next = s->next;
+    kfree((void*)s);
+  }
+}
+
+// Add a new slab to c. Returns 0 if out of memory.
+static int
+grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  struct obj *o;
+  char *p;
+  int i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->inuse = 0;
+  s->freelist = 0;
+  p = (char*)s + SLABHDR;
+  for(i = c->perslab - 1; i >= 0; i--){
+    o = (struct obj*)(p + i*c->size);
+    o->next = s->freelist;
+    s->freelist = o;
+  }
+
+  acquire(&c->lock);
+  s->next = c->partial.next;
+  s->prev = &c->partial;
+  c->partial.next->prev = s;
+  c->partial.next = s;
+  c->nslab++;
+  release(&c->lock);
+  return 1;
+}
+
+// Allocate an object from cache c.
+// Returns 0 if out of memory. The object is not zeroed.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *batch[MAGSIZE/2];
+  void *p;
+  int i, n;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n > 0){
+    p = m->obj[--m->n];
+    release(&m->lock);
+    pop_off();
+    return p;
+  }
+  release(&m->lock);
+
+  // magazine is empty: take one object for the caller and
+  // up to half a magazine for later, growing if necessary.
+  // interrupts stay off, so this CPU's magazine stays ours.
+  for(;;){
+    acquire(&c->lock);
+    p = slab_get(c);
+    n = 0;
+    while(p && n < MAGSIZE/2 && (batch[n] = slab_get(c)) != 0)
+      n++;
+    release(&c->lock);
+    if(p || !grow(c))
+      break;
+  }
+
+  if(n > 0){
+    acquire(&m->lock);
+    for(i = 0; i < n; i++)
+      m->obj[m->n++] = batch[i];
+    release(&m->lock);
+  }
+  pop_off();
+  return p;
+}
+
+// Return object p to cache c.
+void
+kmem_cache_free(struct kmem_cache *c, void *p)
+{
+  struct magazine *m;
+  struct slab *empty;
+  void *batch[MAGSIZE/2];
+  int i, n;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n < MAGSIZE){
+    m->obj[m->n++] = p;
+    release(&m->lock);
+    pop_off();
+    return;
+  }
+  // magazine is full: flush the older half to the slabs.
+  n = MAGSIZE/2;
+  for(i = 0; i < n; i++)
+    batch[i] = m->obj[i];
+  for(i = n; i < MAGSIZE; i++)
+    m->obj[i-n] = m->obj[i];
+  m->n = MAGSIZE - n;
+  m->obj[m->n++] = p;
+  release(&m->lock);
+
+  empty = 0;
+  acquire(&c->lock);
+  for(i = 0; i < n; i++)
+    slab_put(c, batch[i], &empty);
+  release(&c->lock);
+  freeslabs(empty);
+  pop_off();
+}
+
+// Flush every CPU's magazine of cache c back to its slabs,
+// and free the slabs that become empty.
+// Returns the number of pages freed.
+int
+kmem_cache_shrink(struct kmem_cache *c)
+{
+  struct magazine *m;
+  struct slab *empty, *s;
+  void *batch[MAGSIZE];
+  int i, n, freed;
+
+  empty = 0;
+  for(i = 0; i < NCPU; i++){
+    m = &c->mag[i];
+    acquire(&m->lock);
+    n = m->n;
+    for(int j = 0; j < n; j++)
+      batch[j] = m->obj[j];
+    m->n = 0;
+    release(&m->lock);
+
+    acquire(&c->lock);
+    for(int j = 0; j < n; j++)
+      slab_put(c, batch[j], &empty);
+    release(&c->lock);
+  }
+
+  freed = 0;
+  for(s = empty; s; s = s->next)
+    freed++;
+  freeslabs(empty);
+  return freed;
+}
+
+// Report each cache's size and lock contention
+// for the statistics device.
+int
+slabstats(char *buf, int sz)
+{
+  struct kmem_cache *c;
+  int i, j, n, nmag, nacq, nts;
+
+  n = 0;
+  for(i = 0; i < kcaches.n; i++){
+    c = &kcaches.cache[i];
+    nmag = nacq = nts = 0;
+    for(j = 0; j < NCPU; j++){
+      nmag += c->mag[j].n;
+      nacq += c->mag[j].lock.n;
+      nts += c->mag[j].lock.nts;
+    }
+    n += snprintf(buf+n, sz-n,
+                  "slab %s: size %d slabs %d objs %d magazined %d "
+                  "#acquire %d/%d #test-and-set %d/%d\n",
+                  c->name, c->size, c->nslab, c->ninuse - nmag, nmag,
+                  nacq, c->lock.n, nts, c->lock.nts);
+  }
+  return n;
+}
@@ -16,14 +16,24 @@ uint64 timer_scratch[NCPU][5];
 // assembly code in kernelvec.S for machine-mode timer interrupt.
 extern void timervec();
 
+// CLINT_MTIME when hart 0 entered start(), for reporting boot time.
+uint64 boottime;
+
 // entry.S jumps here in machine mode on stack0.
 void
 start()
 {
+  if(r_mhartid() == 0)
+    boottime = *(uint64*)CLINT_MTIME;
+
   // set M Previous Privilege mode to Supervisor, for mret.
   unsigned long x = r_mstatus();
   x &= ~MSTATUS_MPP_MASK;
   x |= MSTATUS_MPP_S;
+#ifdef RVV
+  // turn on the vector unit, for string.c and user programs.
+  x |= MSTATUS_VS_INIT;
+#endif
   w_mstatus(x);
 
   // set M Exception Program Counter to main, for mret.
@@ -43,6 +53,9 @@ start()
   w_pmpaddr0(0x3fffffffffffffull);
   w_pmpcfg0(0xf);
 
+  // let supervisor mode read the time CSR.
+  w_mcounteren(r_mcounteren() | 2);
+
   // ask for clock interrupts.
   timerinit();
 
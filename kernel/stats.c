@@ -0,0 +1,180 @@
+//
+// The statistics device: reading it returns a text snapshot
+// of kernel performance counters, one subsystem after another.
+// init creates it as /statistics; see user/statistics.c.
+//
+// Writing it sets a tunable:
+//   iopoll <data|log> <usec>
+// makes waiters for that class of disk I/O spin for up to usec
+// microseconds before sleeping; 0 turns polling off.
+//   log <sync|relaxed>
+// makes each file system call wait for its log transaction to
+// commit, or (the default) lets commits be deferred and grouped;
+// see log_setsync().
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "buf.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define BUFSZ PGSIZE
+
+// each open file has a snapshot of its own (f->snap), so readers
+// do not disturb each other; the lock protects it from processes
+// that share the file.
+static struct {
+  struct spinlock lock;
+} stats;
+
+// each reporter appends its counters to buf, using at most sz
+// bytes, and returns the number of bytes it used.
+static int (*reporters[])(char*, int) = {
+  bootstats,
+  kallocstats,
+  slabstats,
+  bcachestats,
+  blkstats,
+  logstats,
+#ifdef BLK_RAMDISK
+  ramdiskstats,
+#else
+  virtio_disk_stats,
+#endif
+};
+
+// split the next space-separated word off *s.
+static char*
+word(char **s)
+{
+  char *w;
+
+  while(**s == ' ')
+    (*s)++;
+  w = *s;
+  while(**s && **s != ' ')
+    (*s)++;
+  if(**s)
+    *(*s)++ = 0;
+  return w;
+}
+
+// "log <sync|relaxed>": the log's sync mode; see log_setsync().
+static int
+logcmd(char *s)
+{
+  char *w;
+
+  w = word(&s);
+  if(strncmp(w, "sync", 5) == 0)
+    log_setsync(1);
+  else if(strncmp(w, "relaxed", 8) == 0)
+    log_setsync(0);
+  else
+    return -1;
+  return 0;
+}
+
+// "iopoll <data|log> <usec>": how long virtio_disk_wait() polls.
+static int
+iopollcmd(char *s)
+{
+#ifdef BLK_RAMDISK
+  return -1;  // nothing to poll
+#else
+  char *w;
+  int ioclass, us;
+
+  w = word(&s);
+  if(strncmp(w, "data", 5) == 0)
+    ioclass = IOC_DATA;
+  else if(strncmp(w, "log", 4) == 0)
+    ioclass = IOC_LOG;
+  else
+    return -1;
+  w = word(&s);
+  if(*w == 0)
+    return -1;
+  for(us = 0; *w >= '0' && *w <= '9'; w++)
+    us = us*10 + *w - '0';
+  if(*w != 0)
+    return -1;
+  return virtio_disk_setpoll(ioclass, us);
+#endif
+}
+
+static int
+statswrite(int user_src, uint64 src, int n)
+{
+  char cmd[64], *s, *w;
+  int r;
+
+  if(n <= 0 || n >= sizeof(cmd))
+    return -1;
+  if(either_copyin(cmd, user_src, src, n) == -1)
+    return -1;
+  cmd[n] = 0;
+  if(cmd[n-1] == '\n')
+    cmd[n-1] = 0;
+
+  s = cmd;
+  w = word(&s);
+  if(strncmp(w, "log", 4) == 0)
+    r = logcmd(s);
+  else if(strncmp(w, "iopoll", 7) == 0)
+    r = iopollcmd(s);
+  else
+    r = -1;
+  return r < 0 ? -1 : n;
+}
+
+// The first read of f after open (or after end of file) takes a
+// new snapshot into f->snap; later reads return the rest of it.
+// Returns 0 at the end of the snapshot. fileclose() frees it.
+static int
+statsread(struct file *f, int user_dst, uint64 dst, int n)
+{
+  int i, m;
+
+  acquire(&stats.lock);
+
+  if(f->snapsz == 0){
+    if(f->snap == 0 && (f->snap = kalloc()) == 0){
+      release(&stats.lock);
+      return -1;
+    }
+    for(i = 0; i < NELEM(reporters); i++)
+      f->snapsz += reporters[i](f->snap + f->snapsz, BUFSZ - f->snapsz);
+    f->off = 0;
+  }
+  m = f->snapsz - f->off;
+
+  if(m > 0){
+    if(m > n)
+      m = n;
+    if(either_copyout(user_dst, dst, f->snap + f->off, m) == -1)
+      m = -1;
+    else
+      f->off += m;
+  } else {
+    m = 0;
+    f->snapsz = 0;
+    f->off = 0;
+  }
+  release(&stats.lock);
+  return m;
+}
+
+void
+statsinit(void)
+{
+  initlock(&stats.lock, "stats");
+
+  devsw[STATS].read = statsread;
+  devsw[STATS].write = statswrite;
+}
@@ -1,13 +1,85 @@
 #include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+// memset, memmove and memcpy work a 64-bit word at a time once
+// the destination is aligned (and, for copies, when source and
+// destination are equally misaligned), and a byte at a time
+// otherwise. Built with RVV=1, runs of at least VMIN bytes go
+// through the vector unit instead. The vector loops run with
+// interrupts off, so that nothing else uses the registers
+// meanwhile, and call vclobber() so that usertrapret() reloads
+// the user's vector state (see trap.c).
+
+#define WORD   sizeof(uint64)
+#define VMIN   64
+
+#ifdef RVV
+static void
+vset(char *d, int c, uint n)
+{
+  uint64 vl;
+
+  push_off();
+  vclobber();
+  while(n > 0){
+    asm volatile(VASM("vsetvli %0, %1, e8, m8, ta, ma") : "=r" (vl) : "r" ((uint64)n));
+    asm volatile(VASM("vmv.v.x v0, %0") : : "r" (c));
+    asm volatile(VASM("vse8.v v0, (%0)") : : "r" (d) : "memory");
+    d += vl;
+    n -= vl;
+  }
+  pop_off();
+}
+
+// forward copy; safe for overlap when d < s.
+static void
+vcopy(char *d, const char *s, uint n)
+{
+  uint64 vl;
+
+  push_off();
+  vclobber();
+  while(n > 0){
+    asm volatile(VASM("vsetvli %0, %1, e8, m8, ta, ma") : "=r" (vl) : "r" ((uint64)n));
+    asm volatile(VASM("vle8.v v0, (%0)") : : "r" (s) : "memory");
+    asm volatile(VASM("vse8.v v0, (%0)") : : "r" (d) : "memory");
+    s += vl;
+    d += vl;
+    n -= vl;
+  }
+  pop_off();
+}
+#endif
 
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uint64 w, *wdst;
+
+#ifdef RVV
+  if(n >= VMIN){
+    vset(cdst, c, n);
+    return dst;
+  }
+#endif
+  for(; n > 0 && (uint64)cdst % WORD; n--)
+    *cdst++ = c;
+  if(n >= WORD){
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    wdst = (uint64 *) cdst;
+    for(; n >= WORD; n -= WORD)
+      *wdst++ = w;
+    cdst = (char *) wdst;
   }
+  for(; n > 0; n--)
+    *cdst++ = c;
   return dst;
 }
 
@@ -27,6 +99,46 @@ memcmp(const void *v1, const void *v2, uint n)
   return 0;
 }
 
+// copy front to back, a word at a time if d and s
+// can be aligned together.
+static void
+copyfwd(char *d, const char *s, uint n)
+{
+#ifdef RVV
+  if(n >= VMIN){
+    vcopy(d, s, n);
+    return;
+  }
+#endif
+  if((uint64)d % WORD == (uint64)s % WORD){
+    for(; n > 0 && (uint64)d % WORD; n--)
+      *d++ = *s++;
+    for(; n >= WORD; n -= WORD, d += WORD, s += WORD)
+      *(uint64 *)d = *(const uint64 *)s;
+  }
+  while(n-- > 0)
+    *d++ = *s++;
+}
+
+// copy back to front, for overlapping moves with s < d.
+static void
+copybwd(char *d, const char *s, uint n)
+{
+  d += n;
+  s += n;
+  if((uint64)d % WORD == (uint64)s % WORD){
+    for(; n > 0 && (uint64)d % WORD; n--)
+      *--d = *--s;
+    for(; n >= WORD; n -= WORD){
+      d -= WORD;
+      s -= WORD;
+      *(uint64 *)d = *(const uint64 *)s;
+    }
+  }
+  while(n-- > 0)
+    *--d = *--s;
+}
+
 void*
 memmove(void *dst, const void *src, uint n)
 {
@@ -38,14 +150,10 @@ memmove(void *dst, const void *src, uint n)
   
   s = src;
   d = dst;
-  if(s < d && s + n > d){
-    s += n;
-    d += n;
-    while(n-- > 0)
-      *--d = *--s;
-  } else
-    while(n-- > 0)
-      *d++ = *s++;
+  if(s < d && s + n > d)
+    copybwd(d, s, n);
+  else
+    copyfwd(d, s, n);
 
   return dst;
 }
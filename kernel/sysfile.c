@@ -108,6 +108,54 @@ sys_close(void)
   return 0;
 }
 
+// Commit up to transaction seq. In ordered mode, file data
+// written in place may still be only in the disk's cache if
+// this did not commit, so flush the cache.
+static void
+datasync(uint seq)
+{
+#ifdef LOG_JOURNALDATA
+  log_sync(seq);
+#else
+  if(log_sync(seq) == 0)
+    blk_flush();
+#endif
+}
+
+// Make f's file, and everything the file system did before,
+// durable: commit the open log transaction.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0 || f->type != FD_INODE)
+    return -1;
+  datasync(log_seq());
+  return 0;
+}
+
+// Make f's data and size durable: commit the log transaction
+// that last changed its inode, if it has not committed. An
+// overwrite within the file's size leaves the inode alone, so
+// in ordered mode it needs no commit, only the flush; with
+// JOURNALDATA=1 its data is in the log, and writei() still
+// records the transaction.
+uint64
+sys_fdatasync(void)
+{
+  struct file *f;
+  uint seq;
+
+  if(argfd(0, 0, &f) < 0 || f->type != FD_INODE)
+    return -1;
+  ilock(f->ip);
+  seq = f->ip->logseq;
+  iunlock(f->ip);
+  datasync(seq);
+  return 0;
+}
+
 uint64
 sys_fstat(void)
 {
@@ -130,7 +178,7 @@ sys_link(void)
   if(argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_opn(1 + DIRLINKBLOCKS);  // ip's inode, dirlink()
   if((ip = namei(old)) == 0){
     end_op();
     return -1;
@@ -197,7 +245,7 @@ sys_unlink(void)
   if(argstr(0, path, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_opn(2 + IPUTBLOCKS);  // entry, dp's inode, freeing ip
   if((dp = nameiparent(path, name)) == 0){
     end_op();
     return -1;
@@ -315,7 +363,7 @@ sys_open(void)
   if((n = argstr(0, path, MAXPATH)) < 0)
     return -1;
 
-  begin_op();
+  begin_opn(CREATEBLOCKS);  // also covers O_TRUNC's itrunc()
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
@@ -377,7 +425,7 @@ sys_mkdir(void)
   char path[MAXPATH];
   struct inode *ip;
 
-  begin_op();
+  begin_opn(CREATEBLOCKS);
   if(argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
     end_op();
     return -1;
@@ -394,7 +442,7 @@ sys_mknod(void)
   char path[MAXPATH];
   int major, minor;
 
-  begin_op();
+  begin_opn(CREATEBLOCKS);
   argint(1, &major);
   argint(2, &minor);
   if((argstr(0, path, MAXPATH)) < 0 ||
@@ -414,7 +462,7 @@ sys_chdir(void)
   struct inode *ip;
   struct proc *p = myproc();
   
-  begin_op();
+  begin_opn(IPUTBLOCKS);
   if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
     end_op();
     return -1;
@@ -22,11 +22,72 @@ trapinit(void)
   initlock(&tickslock, "time");
 }
 
+#ifdef RVV
+// User processes and the kernel's memset and memmove (string.c)
+// share each hart's vector registers. A process's vector state
+// is saved in VSTATE(p) on a trap from user space, but only if
+// sstatus.VS says that the process changed it, and is loaded on
+// the way back only if the registers do not still hold it: the
+// hart's c->vowner is the process whose state they hold, and
+// p->vcpu the hart that last saved or loaded p's. vclobber()
+// says that the kernel has used them for itself.
+
+static void
+vsave(struct proc *p)
+{
+  uint64 *vs = VSTATE(p), vlenb;
+  char *v = (char*)(vs + 4);
+
+  asm volatile(VASM("csrr %0, vl") : "=r" (vs[0]));
+  asm volatile(VASM("csrr %0, vtype") : "=r" (vs[1]));
+  asm volatile(VASM("csrr %0, vstart") : "=r" (vs[2]));
+  asm volatile(VASM("csrr %0, vcsr") : "=r" (vs[3]));
+  asm volatile(VASM("csrr %0, vlenb") : "=r" (vlenb));
+  asm volatile(VASM("csrw vstart, zero"));
+  asm volatile(VASM("vs8r.v v0, (%0)") : : "r" (v) : "memory");
+  asm volatile(VASM("vs8r.v v8, (%0)") : : "r" (v + 8*vlenb) : "memory");
+  asm volatile(VASM("vs8r.v v16, (%0)") : : "r" (v + 16*vlenb) : "memory");
+  asm volatile(VASM("vs8r.v v24, (%0)") : : "r" (v + 24*vlenb) : "memory");
+}
+
+static void
+vload(struct proc *p)
+{
+  uint64 *vs = VSTATE(p), vlenb;
+  char *v = (char*)(vs + 4);
+
+  asm volatile(VASM("csrr %0, vlenb") : "=r" (vlenb));
+  asm volatile(VASM("csrw vstart, zero"));
+  asm volatile(VASM("vl8re8.v v0, (%0)") : : "r" (v) : "memory");
+  asm volatile(VASM("vl8re8.v v8, (%0)") : : "r" (v + 8*vlenb) : "memory");
+  asm volatile(VASM("vl8re8.v v16, (%0)") : : "r" (v + 16*vlenb) : "memory");
+  asm volatile(VASM("vl8re8.v v24, (%0)") : : "r" (v + 24*vlenb) : "memory");
+  asm volatile(VASM("vsetvl zero, %0, %1") : : "r" (vs[0]), "r" (vs[1]));
+  asm volatile(VASM("csrw vstart, %0") : : "r" (vs[2]));
+  asm volatile(VASM("csrw vcsr, %0") : : "r" (vs[3]));
+}
+
+// the kernel is about to overwrite this hart's vector registers.
+// Caller must have interrupts off.
+void
+vclobber(void)
+{
+  mycpu()->vowner = 0;
+}
+#endif
+
 // set up to take exceptions and traps while in the kernel.
 void
 trapinithart(void)
 {
   w_stvec((uint64)kernelvec);
+#ifdef RVV
+  // vsave() and vload() use the rest of the trapframe page.
+  uint64 vlenb;
+  asm volatile(VASM("csrr %0, vlenb") : "=r" (vlenb));
+  if(VSTATESZ(vlenb) > PGSIZE - VSTATEOFF)
+    panic("trapinithart: vector registers too long");
+#endif
 }
 
 //
@@ -50,6 +111,15 @@ usertrap(void)
   w_stvec((uint64)kernelvec);
 
   struct proc *p = myproc();
+
+#ifdef RVV
+  // before anything in the kernel uses the vector registers.
+  if((r_sstatus() & SSTATUS_VS) == SSTATUS_VS_DIRTY){
+    vsave(p);
+    p->vcpu = cpuid();
+    mycpu()->vowner = p;
+  }
+#endif
   
   // save user program counter.
   p->trapframe->epc = r_sepc();
@@ -150,6 +220,15 @@ usertrapret(void)
   unsigned long x = r_sstatus();
   x &= ~SSTATUS_SPP; // clear SPP to 0 for user mode
   x |= SSTATUS_SPIE; // enable interrupts in user mode
+#ifdef RVV
+  if(mycpu()->vowner != p || p->vcpu != cpuid()){
+    vload(p);
+    p->vcpu = cpuid();
+    mycpu()->vowner = p;
+  }
+  // so that usertrap() can tell whether p changes them.
+  x = (x & ~SSTATUS_VS) | SSTATUS_VS_CLEAN;
+#endif
   w_sstatus(x);
 
   // set S Exception Program Counter to the saved user pc.
@@ -224,8 +303,8 @@ devintr()
 
     if(irq == UART0_IRQ){
       uartintr();
-    } else if(irq == VIRTIO0_IRQ){
-      virtio_disk_intr();
+    } else if(irq >= VIRTIO0_IRQ && irq < VIRTIO0_IRQ + NVIRTIO){
+      virtio_disk_intr(irq - VIRTIO0_IRQ);
     } else if(irq){
       printf("unexpected interrupt irq=%d\n", irq);
     }
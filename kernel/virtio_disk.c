@@ -4,6 +4,10 @@
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
 //
+// every virtio-mmio slot holding a block device is used, up to
+// NDISK of them, numbered in slot order; blkq.c stripes the file
+// system over them.
+//
 
 #include "types.h"
 #include "riscv.h"
@@ -16,10 +20,13 @@
 #include "buf.h"
 #include "virtio.h"
 
-// the address of virtio mmio register r.
-#define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
+// the address of virtio mmio register r of disk d.
+#define R(d, r) ((volatile uint32 *)((d)->base + (r)))
 
-static struct disk {
+// one virtqueue. with VIRTIO_BLK_F_MQ the device has several,
+// and each hart submits through its own (see blkq.c), so harts
+// do not share a ring or a lock.
+struct vq {
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
   // disk operations. there are NUM descriptors.
@@ -41,12 +48,16 @@ static struct disk {
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
+  uint16 kick_idx; // avail->idx when we last notified the device.
+  int plugged;     // hold back notifications while > 0.
+  int nfwait;      // flushes waiting for free descriptors
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
     struct buf *b;
+    int *flushed;  // set to 1 when a flush request finishes
     char status;
   } info[NUM];
 
@@ -54,111 +65,203 @@ static struct disk {
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
   
-  struct spinlock vdisk_lock;
-  
-} disk;
+  struct spinlock lock;
+
+  // statistics, protected by lock.
+  int inflight;    // requests submitted but not completed
+  int maxinflight; // most requests ever in flight at once
+  uint64 nreq;     // requests submitted
+  uint64 nblock;   // blocks transferred
+  uint64 depthsum; // sum of inflight as seen by each new request
+  uint64 nkick;    // notifications written to the device
+  uint64 nskip;    // notifications the device said it did not need
+  uint64 npoll;    // waits that polled
+  uint64 npollhit; // polls that saw their request finish
+  uint64 nflush;   // cache flushes
+};
+
+struct disk {
+  uint64 base;     // mmio registers
+  uint64 nblocks;  // capacity
+  struct vq q[NCPU];
+  int nq;          // virtqueues in use
+  int event_idx;   // VIRTIO_RING_F_EVENT_IDX was negotiated.
+  int flush;       // VIRTIO_BLK_F_FLUSH was negotiated.
+
+  uint64 nintr;    // interrupts taken; only virtio_disk_intr() writes it
+};
+
+static struct disk disk[NDISK];
+static int ndisk;
+static struct disk *slotdisk[NVIRTIO];  // disk in each virtio-mmio slot
+
+// poll budget per request class, in microseconds.
+static int pollus[NIOCLASS] = { [IOC_LOG] = 50 };
+
+// set up virtqueue i of disk d.
+static void
+vq_init(struct disk *d, int i)
+{
+  struct vq *vq = &d->q[i];
 
-void
-virtio_disk_init(void)
+  initlock(&vq->lock, "virtio_disk");
+
+  *R(d, VIRTIO_MMIO_QUEUE_SEL) = i;
+
+  // ensure the queue is not in use.
+  if(*R(d, VIRTIO_MMIO_QUEUE_READY))
+    panic("virtio disk should not be ready");
+
+  // check maximum queue size.
+  uint32 max = *R(d, VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if(max == 0)
+    panic("virtio disk has no queue");
+  if(max < NUM)
+    panic("virtio disk max queue too short");
+
+  // allocate and zero queue memory.
+  vq->desc = kalloc();
+  vq->avail = kalloc();
+  vq->used = kalloc();
+  if(!vq->desc || !vq->avail || !vq->used)
+    panic("virtio disk kalloc");
+  memset(vq->desc, 0, PGSIZE);
+  memset(vq->avail, 0, PGSIZE);
+  memset(vq->used, 0, PGSIZE);
+
+  // set queue size.
+  *R(d, VIRTIO_MMIO_QUEUE_NUM) = NUM;
+
+  // write physical addresses.
+  *R(d, VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)vq->desc;
+  *R(d, VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)vq->desc >> 32;
+  *R(d, VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)vq->avail;
+  *R(d, VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)vq->avail >> 32;
+  *R(d, VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)vq->used;
+  *R(d, VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)vq->used >> 32;
+
+  // queue is ready.
+  *R(d, VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+  // all NUM descriptors start out unused.
+  for(int j = 0; j < NUM; j++)
+    vq->free[j] = 1;
+}
+
+// set up the block device at d->base.
+static void
+disk_init(struct disk *d)
 {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
 
-  if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
-     *R(VIRTIO_MMIO_VERSION) != 2 ||
-     *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
-     *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
-    panic("could not find virtio disk");
-  }
-  
   // reset device
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   // set ACKNOWLEDGE status bit
   status |= VIRTIO_CONFIG_S_ACKNOWLEDGE;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   // set DRIVER status bit
   status |= VIRTIO_CONFIG_S_DRIVER;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   // negotiate features
-  uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
+  uint64 features = *R(d, VIRTIO_MMIO_DEVICE_FEATURES);
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
   features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
-  *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  *R(d, VIRTIO_MMIO_DRIVER_FEATURES) = features;
+
+  d->event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
+  // without FLUSH the device has no write cache, or writes
+  // through it, and a finished write is already durable.
+  d->flush = (features >> VIRTIO_BLK_F_FLUSH) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   // re-read status to ensure FEATURES_OK is set.
-  status = *R(VIRTIO_MMIO_STATUS);
+  status = *R(d, VIRTIO_MMIO_STATUS);
   if(!(status & VIRTIO_CONFIG_S_FEATURES_OK))
     panic("virtio disk FEATURES_OK unset");
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-
-  // ensure queue 0 is not in use.
-  if(*R(VIRTIO_MMIO_QUEUE_READY))
-    panic("virtio disk should not be ready");
-
-  // check maximum queue size.
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
+  // capacity, in 512-byte sectors.
+  d->nblocks = (*R(d, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_CAPACITY) |
+                (uint64)*R(d, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_CAPACITY + 4) << 32)
+               / (BSIZE / 512);
+
+  // one queue per hart, if the device has enough.
+  d->nq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ))
+    d->nq = *(volatile uint16 *)R(d, VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_NUM_QUEUES);
+  if(d->nq > NCPU)
+    d->nq = NCPU;
+  if(d->nq < 1)
+    panic("virtio disk num_queues");
+  for(int i = 0; i < d->nq; i++)
+    vq_init(d, i);
 
-  // allocate and zero queue memory.
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
-  if(!disk.desc || !disk.avail || !disk.used)
-    panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
-
-  // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  // tell device we're completely ready.
+  status |= VIRTIO_CONFIG_S_DRIVER_OK;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
-  // write physical addresses.
-  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
-  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk.desc >> 32;
-  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk.avail;
-  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk.avail >> 32;
-  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk.used;
-  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk.used >> 32;
+  // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ+slot.
+}
 
-  // queue is ready.
-  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+// Find and set up the virtio block devices.
+void
+virtio_disk_init(void)
+{
+  struct disk *d;
+
+  for(int i = 0; i < NVIRTIO && ndisk < NDISK; i++){
+    d = &disk[ndisk];
+    d->base = VIRTIO(i);
+    if(*R(d, VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
+       *R(d, VIRTIO_MMIO_VERSION) != 2 ||
+       *R(d, VIRTIO_MMIO_DEVICE_ID) != 2 ||
+       *R(d, VIRTIO_MMIO_VENDOR_ID) != 0x554d4551)
+      continue;
+    disk_init(d);
+    slotdisk[i] = d;
+    ndisk++;
+  }
+  if(ndisk == 0)
+    panic("could not find virtio disk");
+}
 
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+// How many disks there are.
+int
+virtio_disk_ndisk(void)
+{
+  return ndisk;
+}
 
-  // tell device we're completely ready.
-  status |= VIRTIO_CONFIG_S_DRIVER_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
+// How many virtqueues requests to disk i can be spread over.
+int
+virtio_disk_nqueue(int i)
+{
+  return disk[i].nq;
+}
 
-  // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
+// Disk i's capacity, in blocks.
+uint64
+virtio_disk_size(int i)
+{
+  return disk[i].nblocks;
 }
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct vq *vq)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(vq->free[i]){
+      vq->free[i] = 0;
       return i;
     }
   }
@@ -167,28 +270,27 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct vq *vq, int i)
 {
   if(i >= NUM)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(vq->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  vq->desc[i].addr = 0;
+  vq->desc[i].len = 0;
+  vq->desc[i].flags = 0;
+  vq->desc[i].next = 0;
+  vq->free[i] = 1;
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct vq *vq, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = vq->desc[i].flags;
+    int nxt = vq->desc[i].next;
+    free_desc(vq, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -196,46 +298,70 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(struct vq *vq, int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+  for(int i = 0; i < n; i++){
+    idx[i] = alloc_desc(vq);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(vq, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// Tell disk d about requests added to vq's avail ring since
+// the last notification, unless, with EVENT_IDX, it has said it
+// will look at them anyway. Caller must hold vq->lock.
+static void
+kick(struct disk *d, struct vq *vq)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint16 old = vq->kick_idx, new = vq->avail->idx;
 
-  acquire(&disk.vdisk_lock);
+  if(new == old)
+    return;
+  vq->kick_idx = new;
 
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  __sync_synchronize();
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+  if(d->event_idx && !VRING_NEED_EVENT(vq->used->avail_event, new, old)){
+    vq->nskip++;
+    return;
+  }
+  vq->nkick++;
+  *R(d, VIRTIO_MMIO_QUEUE_NOTIFY) = vq - d->q; // value is queue number
+}
+
+// Queue one request to disk d that reads or writes the n bufs
+// bs[0..n-1] at the disk's blocks blockno..blockno+n-1. Returns
+// -1, without waiting, if there are not enough free descriptors.
+// Caller must hold vq->lock.
+static int
+submit(struct disk *d, struct vq *vq, uint blockno, struct buf **bs, int n, int write)
+{
+  uint64 sector = (uint64)blockno * (BSIZE / 512);
+  int i;
+
+  if(n < 1 || n > MAXSEG)
+    panic("virtio_disk submit");
+
+  // the spec's Section 5.2 says that block operations use a
+  // descriptor for type/reserved/sector, then descriptors for the
+  // data, then one for a 1-byte status result. each buf gets a
+  // data descriptor of its own, so n bufs need n+2.
+  int idx[MAXSEG+2];
+  if(alloc_descs(vq, idx, n+2) < 0){
+    kick(d, vq);  // so that the device frees some
+    return -1;
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &vq->ops[idx[0]];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -244,57 +370,302 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  vq->desc[idx[0]].addr = (uint64) buf0;
+  vq->desc[idx[0]].len = sizeof(struct virtio_blk_req);
+  vq->desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  vq->desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(i = 0; i < n; i++){
+    vq->desc[idx[i+1]].addr = (uint64) bs[i]->data;
+    vq->desc[idx[i+1]].len = BSIZE;
+    if(write)
+      vq->desc[idx[i+1]].flags = 0; // device reads b->data
+    else
+      vq->desc[idx[i+1]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    vq->desc[idx[i+1]].flags |= VRING_DESC_F_NEXT;
+    vq->desc[idx[i+1]].next = idx[i+2];
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+    // record struct bufs for virtio_disk_intr().
+    bs[i]->disk = 1;
+    bs[i]->qnext = i+1 < n ? bs[i+1] : 0;
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  vq->info[idx[0]].status = 0xff; // device writes 0 on success
+  vq->desc[idx[n+1]].addr = (uint64) &vq->info[idx[0]].status;
+  vq->desc[idx[n+1]].len = 1;
+  vq->desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  vq->desc[idx[n+1]].next = 0;
+
+  vq->info[idx[0]].b = bs[0];
+
+  vq->depthsum += vq->inflight;
+  vq->inflight++;
+  if(vq->inflight > vq->maxinflight)
+    vq->maxinflight = vq->inflight;
+  vq->nreq++;
+  vq->nblock += n;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  vq->avail->ring[vq->avail->idx % NUM] = idx[0];
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  vq->avail->idx += 1; // not % NUM ...
 
-  __sync_synchronize();
+  if(vq->plugged == 0)
+    kick(d, vq);
+  return 0;
+}
+
+// Start a burst of submissions to queue q of disk i: until the
+// matching virtio_disk_unplug(), new requests are queued without
+// notifying the device, so that one notification covers them
+// all. Anyone who waits for the disk notifies it first.
+void
+virtio_disk_plug(int i, int q)
+{
+  struct vq *vq = &disk[i].q[q];
+
+  acquire(&vq->lock);
+  vq->plugged++;
+  release(&vq->lock);
+}
+
+void
+virtio_disk_unplug(int i, int q)
+{
+  struct vq *vq = &disk[i].q[q];
+
+  acquire(&vq->lock);
+  if(--vq->plugged == 0)
+    kick(&disk[i], vq);
+  release(&vq->lock);
+}
+
+// Start a read or write of the n bufs bs[0..n-1] at blocks
+// blockno..blockno+n-1 of disk i, as a single request on queue q,
+// and return without waiting for it; or return -1 if the queue is
+// full. When it finishes, virtio_disk_intr() clears each b->disk
+// and calls b->iodone(b) if set, or else wakes up
+// virtio_disk_wait(). blkq.c is the only caller, and sets each
+// b->hwdisk to i and b->hwq to q.
+int
+virtio_disk_start(int i, int q, uint blockno, struct buf **bs, int n, int write)
+{
+  struct vq *vq = &disk[i].q[q];
+  int r;
+
+  acquire(&vq->lock);
+  r = submit(&disk[i], vq, blockno, bs, n, write);
+  release(&vq->lock);
+  return r;
+}
+
+// Process vq's used ring: mark finished bufs, wake up their
+// waiters, and return those with iodone callbacks on a list
+// through qnext, for the caller to run without vq->lock.
+// Caller must hold vq->lock.
+static struct buf*
+reap(struct disk *d, struct vq *vq)
+{
+  struct buf *done = 0, *b, *next;
+
+  // the device increments vq->used->idx when it
+  // adds an entry to the used ring.
+
+again:
+  while(vq->used_idx != vq->used->idx){
+    __sync_synchronize();
+    int id = vq->used->ring[vq->used_idx % NUM].id;
+
+    if(vq->info[id].status != 0)
+      panic("virtio_disk_intr status");
+
+    for(b = vq->info[id].b; b; b = next){
+      next = b->qnext;
+      b->disk = 0;   // disk is done with buf
+      if(b->iodone){
+        b->qnext = done;
+        done = b;
+      } else {
+        b->qnext = 0;
+        wakeup(b);
+      }
+    }
+    vq->info[id].b = 0;
+    if(vq->info[id].flushed){
+      *vq->info[id].flushed = 1;
+      wakeup(vq->info[id].flushed);
+      vq->info[id].flushed = 0;
+    } else {
+      vq->inflight--;
+    }
+    free_chain(vq, id);
+
+    vq->used_idx += 1;
+  }
+
+  if(vq->nfwait)
+    wakeup(&vq->nfwait);
+
+  if(d->event_idx){
+    // ask for an interrupt at the next completion, then look
+    // again, in case it arrived before the device saw this.
+    vq->avail->used_event = vq->used_idx;
+    __sync_synchronize();
+    if(vq->used_idx != vq->used->idx)
+      goto again;
+  }
+  return done;
+}
+
+// Run the completion callbacks of a list from reap(), and give
+// the block queue for queue q of disk i the descriptors that
+// were freed.
+static void
+iodone(int i, int q, struct buf *done)
+{
+  struct buf *b, *next;
+
+  for(b = done; b; b = next){
+    next = b->qnext;
+    b->qnext = 0;
+    b->iodone(b);
+  }
+  blk_dispatch(i, q);
+}
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+// Wait for the disk to finish with b. If b's request class
+// has a poll budget, first spin for up to that long watching
+// the used ring, which avoids interrupt and wakeup latency
+// when the device is quick; then sleep.
+void
+virtio_disk_wait(struct buf *b)
+{
+  struct disk *d = &disk[b->hwdisk];
+  struct vq *vq = &d->q[b->hwq];
+  uint64 deadline;
+  int us;
+
+  acquire(&vq->lock);
+
+  if(b->disk == 1)
+    kick(d, vq);
+
+  us = pollus[b->ioclass];
+  if(b->disk == 1 && us > 0){
+    vq->npoll++;
+    deadline = r_time() + (uint64)us * (TIMEBASE / 1000000);
+    release(&vq->lock);
+    for(;;){
+      __sync_synchronize();
+      if(b->disk == 0 || r_time() >= deadline)
+        break;
+      if(vq->used_idx != vq->used->idx){
+        acquire(&vq->lock);
+        struct buf *done = reap(d, vq);
+        release(&vq->lock);
+        iodone(b->hwdisk, b->hwq, done);
+      }
+    }
+    acquire(&vq->lock);
+    if(b->disk == 0)
+      vq->npollhit++;
+  }
 
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+    sleep(b, &vq->lock);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  release(&vq->lock);
+}
+
+// Flush disk i's write cache, and wait for the device to say
+// that every write that had finished before the call is durable.
+// Writes still in flight are not covered. Does nothing if the
+// device did not offer VIRTIO_BLK_F_FLUSH.
+void
+virtio_disk_flush(int i)
+{
+  struct disk *d = &disk[i];
+  struct vq *vq;
+  int idx[2], cpu, flushed;
+
+  if(!d->flush)
+    return;
+
+  push_off();
+  cpu = cpuid();
+  pop_off();
+  vq = &d->q[cpu % d->nq];
+
+  acquire(&vq->lock);
+  while(alloc_descs(vq, idx, 2) < 0){
+    kick(d, vq);  // so that the device frees some
+    vq->nfwait++;
+    sleep(&vq->nfwait, &vq->lock);
+    vq->nfwait--;
+  }
+
+  // a flush is a header and a status, with no data.
+  struct virtio_blk_req *buf0 = &vq->ops[idx[0]];
+
+  buf0->type = VIRTIO_BLK_T_FLUSH;
+  buf0->reserved = 0;
+  buf0->sector = 0;
+
+  vq->desc[idx[0]].addr = (uint64) buf0;
+  vq->desc[idx[0]].len = sizeof(struct virtio_blk_req);
+  vq->desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  vq->desc[idx[0]].next = idx[1];
+
+  vq->info[idx[0]].status = 0xff;
+  vq->desc[idx[1]].addr = (uint64) &vq->info[idx[0]].status;
+  vq->desc[idx[1]].len = 1;
+  vq->desc[idx[1]].flags = VRING_DESC_F_WRITE;
+  vq->desc[idx[1]].next = 0;
 
-  release(&disk.vdisk_lock);
+  flushed = 0;
+  vq->info[idx[0]].b = 0;
+  vq->info[idx[0]].flushed = &flushed;
+  vq->nflush++;
+
+  vq->avail->ring[vq->avail->idx % NUM] = idx[0];
+  __sync_synchronize();
+  vq->avail->idx += 1;
+  kick(d, vq);
+
+  while(flushed == 0)
+    sleep(&flushed, &vq->lock);
+
+  release(&vq->lock);
+}
+
+// Set how many microseconds virtio_disk_wait() polls for
+// requests of class ioclass before sleeping; 0 turns polling off.
+int
+virtio_disk_setpoll(int ioclass, int us)
+{
+  if(ioclass < 0 || ioclass >= NIOCLASS || us < 0)
+    return -1;
+  pollus[ioclass] = us;
+  return 0;
 }
 
+// Each device has one interrupt for all its queues, so whichever
+// hart the PLIC delivers it to reaps every queue.
 void
-virtio_disk_intr()
+virtio_disk_intr(int slot)
 {
-  acquire(&disk.vdisk_lock);
+  struct disk *d = slotdisk[slot];
+  struct buf *done;
+
+  if(d == 0){
+    printf("virtio_disk_intr: no disk in slot %d\n", slot);
+    return;
+  }
 
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
@@ -302,26 +673,78 @@ virtio_disk_intr()
   // the "used" ring, in which case we may process the new
   // completion entries in this interrupt, and have nothing to do
   // in the next interrupt, which is harmless.
-  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+  *R(d, VIRTIO_MMIO_INTERRUPT_ACK) = *R(d, VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+  d->nintr++;
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
+  for(int q = 0; q < d->nq; q++){
+    struct vq *vq = &d->q[q];
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    if(vq->used_idx == vq->used->idx)
+      continue;
+    acquire(&vq->lock);
+    done = reap(d, vq);
+    release(&vq->lock);
 
-    disk.used_idx += 1;
+    // completion callbacks and the block queue take other locks.
+    iodone(d - disk, q, done);
   }
+}
 
-  release(&disk.vdisk_lock);
+// Report request counts and queue depth, summed over the
+// disks and their queues, for the statistics device. avgdepth
+// is the mean number of requests already in flight on a queue
+// when one is submitted.
+int
+virtio_disk_stats(char *buf, int sz)
+{
+  uint64 nreq = 0, nblock = 0, depthsum = 0, nkick = 0, nskip = 0;
+  uint64 npoll = 0, npollhit = 0, nintr = 0, nflush = 0;
+  int n, inflight = 0, maxinflight = 0;
+
+  n = snprintf(buf, sz, "virtio: disks %d requests per queue:", ndisk);
+  for(int i = 0; i < ndisk; i++){
+    struct disk *d = &disk[i];
+
+    if(i > 0)
+      n += snprintf(buf+n, sz-n, " |");
+    for(int q = 0; q < d->nq; q++){
+      struct vq *vq = &d->q[q];
+
+      acquire(&vq->lock);
+      n += snprintf(buf+n, sz-n, " %d", (int)vq->nreq);
+      nreq += vq->nreq;
+      nblock += vq->nblock;
+      depthsum += vq->depthsum;
+      nkick += vq->nkick;
+      nskip += vq->nskip;
+      npoll += vq->npoll;
+      npollhit += vq->npollhit;
+      nflush += vq->nflush;
+      inflight += vq->inflight;
+      if(vq->maxinflight > maxinflight)
+        maxinflight = vq->maxinflight;
+      release(&vq->lock);
+    }
+    nintr += d->nintr;
+  }
+  n += snprintf(buf+n, sz-n, "\n");
+  n += snprintf(buf+n, sz-n,
+                "virtio: requests %d blocks %d inflight %d max %d "
+                "avgdepth %d.%d\n",
+                (int)nreq, (int)nblock, inflight, maxinflight,
+                nreq ? (int)(depthsum / nreq) : 0,
+                nreq ? (int)(depthsum * 10 / nreq % 10) : 0);
+  // each kick and each interrupt is a VM exit under qemu.
+  n += snprintf(buf+n, sz-n,
+                "virtio: kicks %d skipped %d interrupts %d exits/MB %d "
+                "flushes %d\n",
+                (int)nkick, (int)nskip, (int)nintr,
+                nblock ? (int)((nkick + nintr) * 1024 / nblock) : 0,
+                (int)nflush);
+  n += snprintf(buf+n, sz-n, "virtio: polls %d hits %d poll-us %d %d\n",
+                (int)npoll, (int)npollhit,
+                pollus[IOC_DATA], pollus[IOC_LOG]);
+  return n;
 }
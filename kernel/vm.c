@@ -26,14 +26,18 @@ kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
 
-  // virtio mmio disk interface
-  kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
+  // virtio mmio disk interfaces
+  kvmmap(kpgtbl, VIRTIO0, VIRTIO0, NVIRTIO*PGSIZE, PTE_R | PTE_W);
+
+#ifdef BLK_RAMDISK
+  // the file system image.
+  kvmmap(kpgtbl, RAMDISK, RAMDISK, PGROUNDUP(FSSIZE*BSIZE), PTE_R | PTE_W);
+#endif
 
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
@@ -98,9 +102,8 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
@@ -212,10 +215,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -229,8 +231,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -248,12 +249,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -466,7 +466,7 @@ do_mmap_page(struct vma *vma, uint64 addr, pte_t *pte) {
   uint64 pte_flags;
   int rc;
 
-  mem = kalloc();
+  mem = kalloc_zeroed();
   if (mem == 0) {
     return -1;
   }
@@ -480,11 +480,7 @@ do_mmap_page(struct vma *vma, uint64 addr, pte_t *pte) {
     return -2;
   }
   iunlock(f->ip);
-
-  // zero-fill the rest of the page
-  if (rc < PGSIZE) {
-    memset(mem + rc, 0, PGSIZE - rc);
-  }
+  // the page came zeroed, so a short read leaves the rest zero.
 
   pte_flags = PTE_FLAGS(*pte);
   pte_flags |= (vma->prot & PROT_RWX_MASK) << 1;
@@ -553,18 +549,15 @@ munmap(struct proc *p, uint64 start, uint64 end) {
       continue;
     }
     if (iter->flags & MAP_SHARED) {
-      begin_op();
+      // writeback() makes its own ops.
       for (addr = l; addr < r; addr += PGSIZE) {
         pte = walk(p->pagetable, addr, 0);
         flags = PTE_FLAGS(*pte);
         if (flags & PTE_D) {
-          if (writeback(iter->f, iter->offset + addr - iter->start, addr, 1) < 0) {
-            end_op();
+          if (writeback(iter->f, iter->offset + addr - iter->start, addr, 1) < 0)
             return -1;
-          }
         }
       }
-      end_op();
     }
     uvmunmap(p->pagetable, l, (r - l) / PGSIZE, 1);
     if (l == iter->start && r == iter->end) {
@@ -22,11 +22,13 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = LOGBLOCKS;   // log blocks, header included; set with -l n
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
+int ndisk = 1;      // with -s n, also write n striped member images
+int diskfd[NDISK];
 struct superblock sb;
 char zeroes[BSIZE];
 uint freeinode = 1;
@@ -77,8 +79,19 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  while(argc > 2 && argv[1][0] == '-'){
+    if(strcmp(argv[1], "-s") == 0)
+      ndisk = atoi(argv[2]);
+    else if(strcmp(argv[1], "-l") == 0)
+      nlog = atoi(argv[2]);
+    else
+      break;
+    argc -= 2;
+    argv += 2;
+  }
+  if(argc < 2 || ndisk < 1 || ndisk > NDISK ||
+     nlog < 2*MAXOPBLOCKS+1 || nlog > LOGSIZE+1){
+    fprintf(stderr, "Usage: mkfs [-s ndisk] [-l nlog] fs.img files...\n");
     exit(1);
   }
 
@@ -89,6 +102,17 @@ main(int argc, char *argv[])
   if(fsfd < 0)
     die(argv[1]);
 
+  // RAID-0 members fs.img.0, fs.img.1, ..., for the kernel to
+  // stripe over that many disks; fs.img holds the same blocks
+  // unstriped.
+  for(i = 0; ndisk > 1 && i < ndisk; i++){
+    char name[256];
+    snprintf(name, sizeof(name), "%s.%d", argv[1], i);
+    diskfd[i] = open(name, O_RDWR|O_CREAT|O_TRUNC, 0666);
+    if(diskfd[i] < 0)
+      die(name);
+  }
+
   // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
   nblocks = FSSIZE - nmeta;
@@ -101,6 +125,7 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.ndisk = xint(ndisk);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
          nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
@@ -179,6 +204,15 @@ wsect(uint sec, void *buf)
     die("lseek");
   if(write(fsfd, buf, BSIZE) != BSIZE)
     die("write");
+
+  if(ndisk > 1){
+    int fd = diskfd[STRIPEDISK(sec, ndisk)];
+    uint bn = STRIPEBLOCK(sec, ndisk);
+    if(lseek(fd, bn * BSIZE, 0) != bn * BSIZE)
+      die("lseek");
+    if(write(fd, buf, BSIZE) != BSIZE)
+      die("write");
+  }
 }
 
 void
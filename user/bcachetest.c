@@ -0,0 +1,119 @@
+//
+// Buffer cache scaling test: several processes each read their
+// own file over and over in parallel, so nearly every bread() is
+// a cache hit and the cost is in bget()'s locking. Prints the
+// elapsed ticks and the buffer cache's counters. Run with
+// different CPUS= settings to compare.
+//
+// usage: bcachetest [nproc]
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+#define NCHILD  4
+#define NBLOCK  8     // blocks per file
+#define ROUNDS  400   // times each child reads its file
+
+void
+fname(char *name, int i)
+{
+  strcpy(name, "bct0");
+  name[3] = '0' + i;
+}
+
+void
+createfile(int i)
+{
+  char name[8], data[BSIZE];
+  int fd, b;
+
+  fname(name, i);
+  if((fd = open(name, O_CREATE | O_WRONLY)) < 0){
+    printf("bcachetest: create %s failed\n", name);
+    exit(1);
+  }
+  for(b = 0; b < NBLOCK; b++){
+    memset(data, 'a' + i, sizeof(data));
+    if(write(fd, data, sizeof(data)) != sizeof(data)){
+      printf("bcachetest: write %s failed\n", name);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+void
+child(int i)
+{
+  char name[8], data[BSIZE];
+  int fd, r, b;
+
+  fname(name, i);
+  for(r = 0; r < ROUNDS; r++){
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf("bcachetest: open %s failed\n", name);
+      exit(1);
+    }
+    for(b = 0; b < NBLOCK; b++){
+      if(read(fd, data, sizeof(data)) != sizeof(data) || data[0] != 'a' + i){
+        printf("bcachetest: read %s failed\n", name);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nchild, i, t0, status, fail;
+  char name[8];
+
+  nchild = NCHILD;
+  if(argc > 1)
+    nchild = atoi(argv[1]);
+  if(nchild < 1 || nchild > 10){
+    printf("bcachetest: 1 to 10 processes\n");
+    exit(1);
+  }
+
+  for(i = 0; i < nchild; i++)
+    createfile(i);
+
+  printf("bcachetest: %d processes\n", nchild);
+  t0 = uptime();
+  for(i = 0; i < nchild; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("bcachetest: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      child(i);
+  }
+  fail = 0;
+  for(i = 0; i < nchild; i++){
+    wait(&status);
+    if(status != 0)
+      fail = 1;
+  }
+  printf("bcachetest: %d ticks\n", uptime() - t0);
+  printstats("bcache");
+
+  for(i = 0; i < nchild; i++){
+    fname(name, i);
+    unlink(name);
+  }
+  if(fail){
+    printf("bcachetest: FAIL\n");
+    exit(1);
+  }
+  printf("bcachetest: OK\n");
+  exit(0);
+}
@@ -0,0 +1,225 @@
+//
+// Log commit latency: each iteration creates a small file,
+// writes a block to it and unlinks it, so every system call
+// ends in a small commit and the time is mostly spent waiting
+// for the log's disk writes. Runs once with the log's I/O
+// sleeping for completion and once polling for it, and prints
+// the ticks and the log, block queue and virtio counters for
+// each.
+//
+// With -b, measures commits of BIGTX blocks instead: each
+// iteration rewrites BIGTX-1 blocks of a file in place (the
+// inode is the last block), then sleeps past the log's commit
+// timer so that they commit as one transaction, and prints the
+// average size and latency of the commits made meanwhile.
+//
+// With -f, measures what durability costs: appends n blocks to a
+// file, one write at a time, with commits grouped as usual, then
+// calling fdatasync() after each write, then fsync(), then with
+// the log in sync mode, and prints the ticks and the log counters
+// for each.
+//
+// usage: commitbench [-b | -f] [n [usec]]
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+#define N   200
+#define US  50     // default poll budget, microseconds
+#define BIGTX 30   // blocks per transaction with -b
+
+char big[(BIGTX-1)*BSIZE];
+
+// set the log class's poll budget through the statistics device.
+// Returns -1 if the kernel has no disk to poll (RAMDISK=1).
+int
+setpoll(int us)
+{
+  char cmd[32], num[12];
+  int fd, i, n;
+
+  i = sizeof(num);
+  do {
+    num[--i] = '0' + us % 10;
+    us /= 10;
+  } while(us > 0);
+  strcpy(cmd, "iopoll log ");
+  n = strlen(cmd);
+  memmove(cmd + n, num + i, sizeof(num) - i);
+  n += sizeof(num) - i;
+
+  if((fd = open("statistics", O_WRONLY)) < 0){
+    printf("commitbench: cannot open statistics\n");
+    exit(1);
+  }
+  if(write(fd, cmd, n) != n)
+    n = -1;
+  close(fd);
+  return n < 0 ? -1 : 0;
+}
+
+// put the log in sync or relaxed mode through the statistics device.
+void
+setlog(char *mode)
+{
+  char cmd[16];
+  int fd, n;
+
+  strcpy(cmd, "log ");
+  strcpy(cmd + 4, mode);
+  n = strlen(cmd);
+  if((fd = open("statistics", O_WRONLY)) < 0 || write(fd, cmd, n) != n){
+    printf("commitbench: cannot set log %s\n", mode);
+    exit(1);
+  }
+  close(fd);
+}
+
+// append n blocks to cbsync, calling sync(fd) after each write
+// if sync is set.
+void
+syncrun(int n, char *what, int (*sync)(int))
+{
+  char data[BSIZE];
+  int i, fd, t0, c0, s0;
+
+  memset(data, 's', sizeof(data));
+  if((fd = open("cbsync", O_CREATE | O_TRUNC | O_WRONLY)) < 0){
+    printf("commitbench: cannot create cbsync\n");
+    exit(1);
+  }
+  c0 = getstat("log:", "commits");
+  s0 = getstat("log:", "synced");
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    if(write(fd, data, sizeof(data)) != sizeof(data)){
+      printf("commitbench: write failed\n");
+      exit(1);
+    }
+    if(sync && sync(fd) < 0){
+      printf("commitbench: %s failed\n", what);
+      exit(1);
+    }
+  }
+  printf("commitbench: %s: %d writes in %d ticks, %d commits, %d synced\n",
+         what, n, uptime() - t0, getstat("log:", "commits") - c0,
+         getstat("log:", "synced") - s0);
+  close(fd);
+  unlink("cbsync");
+  sleep(2);
+}
+
+void
+run(int n, int us)
+{
+  char data[BSIZE];
+  int i, fd, t0;
+
+  memset(data, 'c', sizeof(data));
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    if((fd = open("cbtmp", O_CREATE | O_WRONLY)) < 0){
+      printf("commitbench: create failed\n");
+      exit(1);
+    }
+    if(write(fd, data, sizeof(data)) != sizeof(data)){
+      printf("commitbench: write failed\n");
+      exit(1);
+    }
+    close(fd);
+    unlink("cbtmp");
+  }
+  printf("commitbench: poll %d us: %d iterations in %d ticks\n",
+         us, n, uptime() - t0);
+  printstats("log");
+  printstats("blkq");
+  printstats("virtio");
+  printstats("ramdisk");
+}
+
+void
+bigrun(int n)
+{
+  int i, fd, c0, us0, b0, c, us, b;
+
+  memset(big, 'b', sizeof(big));
+  if((fd = open("cbbig", O_CREATE | O_WRONLY)) < 0 ||
+     write(fd, big, sizeof(big)) != sizeof(big)){
+    printf("commitbench: cannot create cbbig\n");
+    exit(1);
+  }
+  close(fd);
+  sleep(2);
+
+  // the statistics give averages since boot.
+  c0 = getstat("log:", "commits");
+  us0 = c0 * getstat("log:", "avg-us");
+  b0 = c0 * getstat("log:", "blocks/commit");
+  for(i = 0; i < n; i++){
+    if((fd = open("cbbig", O_WRONLY)) < 0 ||
+       write(fd, big, sizeof(big)) != sizeof(big)){
+      printf("commitbench: write failed\n");
+      exit(1);
+    }
+    close(fd);
+    sleep(2);
+  }
+  c = getstat("log:", "commits");
+  us = c * getstat("log:", "avg-us") - us0;
+  b = c * getstat("log:", "blocks/commit") - b0;
+  c -= c0;
+  unlink("cbbig");
+
+  printf("commitbench: %d commits of %d blocks on average, avg %d us\n",
+         c, c ? b / c : 0, c ? us / c : 0);
+  printstats("log");
+  printstats("blkq");
+  printstats("virtio");
+  printstats("ramdisk");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n, us;
+
+  n = N;
+  us = US;
+  if(argc > 1 && strcmp(argv[1], "-b") == 0){
+    bigrun(argc > 2 ? atoi(argv[2]) : 20);
+    exit(0);
+  }
+  if(argc > 1 && strcmp(argv[1], "-f") == 0){
+    n = argc > 2 ? atoi(argv[2]) : 100;
+    if(n > MAXFILE)
+      n = MAXFILE;
+    syncrun(n, "grouped", 0);
+    syncrun(n, "fdatasync", fdatasync);
+    syncrun(n, "fsync", fsync);
+    setlog("sync");
+    syncrun(n, "log sync", 0);
+    setlog("relaxed");
+    printstats("log");
+    printstats("virtio");
+    exit(0);
+  }
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(argc > 2)
+    us = atoi(argv[2]);
+
+  if(setpoll(0) < 0){
+    // ramdisk: one run, with no disk latency at all.
+    run(n, 0);
+    exit(0);
+  }
+  run(n, 0);
+  setpoll(us);
+  run(n, us);
+  setpoll(US);
+  exit(0);
+}
@@ -23,6 +23,9 @@ main(void)
   dup(0);  // stdout
   dup(0);  // stderr
 
+  // fails harmlessly if it already exists.
+  mknod("statistics", STATS, 0);
+
   for(;;){
     printf("init: starting sh\n");
     pid = fork();
@@ -0,0 +1,74 @@
+//
+// Page allocator scaling test: several processes grow and
+// shrink their heaps in parallel, which hammers kalloc() and
+// kfree(). Prints the elapsed ticks and the allocator's lock
+// contention counters. Run with different CPUS= settings to
+// compare.
+//
+// usage: kalloctest [nproc]
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NCHILD 4
+#define N      20000
+#define NPAGE  4
+
+void
+child(void)
+{
+  char *a;
+  int i;
+
+  for(i = 0; i < N; i++){
+    a = sbrk(NPAGE*PGSIZE);
+    if(a == (char*)-1){
+      printf("kalloctest: sbrk failed\n");
+      exit(1);
+    }
+    for(int j = 0; j < NPAGE; j++)
+      a[j*PGSIZE] = i;
+    sbrk(-NPAGE*PGSIZE);
+  }
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nchild, i, t0, status, fail;
+
+  nchild = NCHILD;
+  if(argc > 1)
+    nchild = atoi(argv[1]);
+
+  printf("kalloctest: %d processes\n", nchild);
+  t0 = uptime();
+  for(i = 0; i < nchild; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("kalloctest: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      child();
+  }
+  fail = 0;
+  for(i = 0; i < nchild; i++){
+    wait(&status);
+    if(status != 0)
+      fail = 1;
+  }
+  printf("kalloctest: %d ticks\n", uptime() - t0);
+  printstats("kmem");
+  printstats("kpool");
+  if(fail){
+    printf("kalloctest: FAIL\n");
+    exit(1);
+  }
+  printf("kalloctest: OK\n");
+  exit(0);
+}
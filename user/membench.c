@@ -0,0 +1,160 @@
+//
+// Compare byte, word and (when built with RVV=1) vector loops
+// for setting and copying a page, the way kernel/string.c does.
+// Prints the ticks each variant takes for N page-sized operations.
+// Then runs each variant N times more, untimed, checking every
+// result, and exits with status 1 if any is wrong; with RVV=1
+// that checks that the kernel keeps the process's vector
+// registers across traps and context switches.
+//
+// usage: membench [n]
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define N 20000
+
+char src[PGSIZE] __attribute__((aligned(PGSIZE)));
+char dst[PGSIZE] __attribute__((aligned(PGSIZE)));
+
+void
+byteset(char *d, int c, uint n)
+{
+  while(n-- > 0)
+    *d++ = c;
+}
+
+void
+bytecopy(char *d, const char *s, uint n)
+{
+  while(n-- > 0)
+    *d++ = *s++;
+}
+
+// d and n are multiples of 8.
+void
+wordset(char *d, int c, uint n)
+{
+  uint64 w, *wd;
+
+  w = (uchar)c;
+  w |= w << 8;
+  w |= w << 16;
+  w |= w << 32;
+  for(wd = (uint64*)d; n > 0; n -= 8)
+    *wd++ = w;
+}
+
+// d, s and n are multiples of 8.
+void
+wordcopy(char *d, const char *s, uint n)
+{
+  uint64 *wd = (uint64*)d;
+  const uint64 *ws = (const uint64*)s;
+
+  for(; n > 0; n -= 8)
+    *wd++ = *ws++;
+}
+
+#ifdef RVV
+void
+vecset(char *d, int c, uint n)
+{
+  uint64 vl;
+
+  while(n > 0){
+    asm volatile("vsetvli %0, %1, e8, m8, ta, ma" : "=r" (vl) : "r" ((uint64)n));
+    asm volatile("vmv.v.x v0, %0" : : "r" (c));
+    asm volatile("vse8.v v0, (%0)" : : "r" (d) : "memory");
+    d += vl;
+    n -= vl;
+  }
+}
+
+void
+veccopy(char *d, const char *s, uint n)
+{
+  uint64 vl;
+
+  while(n > 0){
+    asm volatile("vsetvli %0, %1, e8, m8, ta, ma" : "=r" (vl) : "r" ((uint64)n));
+    asm volatile("vle8.v v0, (%0)" : : "r" (s) : "memory");
+    asm volatile("vse8.v v0, (%0)" : : "r" (d) : "memory");
+    s += vl;
+    d += vl;
+    n -= vl;
+  }
+}
+#endif
+
+void
+benchset(char *name, void (*fn)(char*, int, uint), int n)
+{
+  int i, j, t0;
+
+  t0 = uptime();
+  for(i = 0; i < n; i++)
+    fn(dst, i, PGSIZE);
+  printf("set  %s: %d ticks\n", name, uptime() - t0);
+
+  for(i = 0; i < n; i++){
+    fn(dst, i, PGSIZE);
+    for(j = 0; j < PGSIZE; j++){
+      if(dst[j] != (char)i){
+        printf("set  %s: wrong byte %d in operation %d\n", name, j, i);
+        exit(1);
+      }
+    }
+  }
+}
+
+void
+benchcopy(char *name, void (*fn)(char*, const char*, uint), int n)
+{
+  int i, t0;
+
+  t0 = uptime();
+  for(i = 0; i < n; i++)
+    fn(dst, src, PGSIZE);
+  printf("copy %s: %d ticks\n", name, uptime() - t0);
+
+  for(i = 0; i < n; i++){
+    memset(dst, 0, PGSIZE);
+    fn(dst, src, PGSIZE);
+    if(memcmp(dst, src, PGSIZE) != 0){
+      printf("copy %s: mismatch in operation %d\n", name, i);
+      exit(1);
+    }
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n;
+
+  n = N;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  for(i = 0; i < PGSIZE; i++)
+    src[i] = i * 7;
+
+  printf("membench: %d operations on %d bytes\n", n, PGSIZE);
+  benchset("byte", byteset, n);
+  benchset("word", wordset, n);
+#ifdef RVV
+  benchset("rvv ", vecset, n);
+#endif
+  benchcopy("byte", bytecopy, n);
+  benchcopy("word", wordcopy, n);
+#ifdef RVV
+  benchcopy("rvv ", veccopy, n);
+#else
+  printf("rvv: not built; use make RVV=1\n");
+#endif
+  printf("membench: results OK\n");
+  exit(0);
+}
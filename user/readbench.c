@@ -0,0 +1,58 @@
+//
+// Sequential read throughput, like cat(1) with the output
+// thrown away. Prints the time taken, the throughput, and the
+// buffer cache's counters, including readahead.
+//
+// Files are at most MAXFILE blocks, so the default is the
+// largest file in fs.img; run it right after boot for a cold
+// cache.
+//
+// usage: readbench [file [chunk]]
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+char buf[8192];
+
+int
+main(int argc, char *argv[])
+{
+  char *name;
+  int fd, n, chunk, total, t;
+
+  name = "usertests";
+  chunk = 512;
+  if(argc > 1)
+    name = argv[1];
+  if(argc > 2)
+    chunk = atoi(argv[2]);
+  if(chunk <= 0 || chunk > sizeof(buf)){
+    printf("readbench: chunk must be 1..%d\n", (int)sizeof(buf));
+    exit(1);
+  }
+
+  if((fd = open(name, O_RDONLY)) < 0){
+    printf("readbench: cannot open %s\n", name);
+    exit(1);
+  }
+  total = 0;
+  t = uptime();
+  while((n = read(fd, buf, chunk)) > 0)
+    total += n;
+  t = uptime() - t;
+  close(fd);
+  if(n < 0){
+    printf("readbench: read error\n");
+    exit(1);
+  }
+
+  printf("readbench: %d bytes in %d ticks", total, t);
+  if(t > 0)
+    printf(", %d KB/s", total / 1024 * 10 / t);
+  printf("\n");
+  printstats("bcache");
+  exit(0);
+}
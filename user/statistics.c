@@ -0,0 +1,67 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+// Read a snapshot of the kernel's statistics device into buf.
+// Returns the number of bytes read.
+int
+statistics(void *buf, int sz)
+{
+  int fd, i, n;
+
+  fd = open("statistics", O_RDONLY);
+  if(fd < 0) {
+    fprintf(2, "stats: open failed\n");
+    exit(1);
+  }
+  for (i = 0; i < sz; ) {
+    if ((n = read(fd, buf+i, sz-i)) <= 0) {
+      break;
+    }
+    i += n;
+  }
+  close(fd);
+  return i;
+}
+
+static char snap[4096];
+
+// Print the lines of a statistics snapshot that start with prefix.
+void
+printstats(char *prefix)
+{
+  int n, i, j, len;
+
+  n = statistics(snap, sizeof(snap));
+  len = strlen(prefix);
+  for(i = 0; i < n; i = j + 1){
+    for(j = i; j < n && snap[j] != '\n'; j++)
+      ;
+    if(j - i >= len && memcmp(snap + i, prefix, len) == 0)
+      write(1, snap + i, j - i + 1);
+  }
+}
+
+// The number after " key " in the statistics line that starts
+// with prefix, or 0.
+int
+getstat(char *prefix, char *key)
+{
+  int n, i, j, k, len, klen;
+
+  n = statistics(snap, sizeof(snap));
+  len = strlen(prefix);
+  klen = strlen(key);
+  for(i = 0; i < n; i = j + 1){
+    for(j = i; j < n && snap[j] != '\n'; j++)
+      ;
+    if(j - i < len || memcmp(snap + i, prefix, len) != 0)
+      continue;
+    for(k = i; k + klen + 2 < j; k++)
+      if(snap[k] == ' ' && memcmp(snap + k + 1, key, klen) == 0 &&
+         snap[k + klen + 1] == ' ')
+        return atoi(snap + k + klen + 2);
+  }
+  return 0;
+}
@@ -0,0 +1,17 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define SZ 4096
+char buf[SZ];
+
+// print the kernel's performance counters.
+int
+main(int argc, char *argv[])
+{
+  int n;
+
+  n = statistics(buf, SZ);
+  write(1, buf, n);
+  exit(0);
+}
@@ -28,6 +28,8 @@ int sleep(int);
 int uptime(void);
 void *mmap(void*, size_t, int, int, int, off_t);
 int munmap(void*, size_t);
+int fsync(int);
+int fdatasync(int);
 #ifdef LAB_NET
 int connect(uint32, uint16, uint16);
 #endif
@@ -53,6 +55,8 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
-#ifdef LAB_LOCK
+
+// statistics.c
 int statistics(void*, int);
-#endif
+void printstats(char*);
+int getstat(char*, char*);
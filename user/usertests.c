@@ -575,6 +575,69 @@ writetest(char *s)
   }
 }
 
+// write one byte to fd, then call sync on it, until the call
+// commits: the logger may commit the write first.
+static int
+syncs(int fd, int (*sync)(int))
+{
+  int i, n;
+
+  for(i = 0; i < 5; i++){
+    if(write(fd, "x", 1) != 1)
+      return -1;
+    n = getstat("log:", "synced");
+    if(sync(fd) != 0)
+      return -1;
+    if(getstat("log:", "synced") > n)
+      return 1;
+  }
+  return 0;
+}
+
+// fsync() and fdatasync() commit a file's writes, refuse
+// pipes and devices, and do not commit for an unmodified file.
+void
+synctest(char *s)
+{
+  int fd, fds[2], n;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(fsync(fds[0]) != -1 || fdatasync(fds[1]) != -1){
+    printf("%s: sync of a pipe succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  if(fsync(1) != -1 || fdatasync(1) != -1){
+    printf("%s: sync of the console succeeded\n", s);
+    exit(1);
+  }
+
+  fd = open("synctest", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create synctest failed\n", s);
+    exit(1);
+  }
+  if(syncs(fd, fdatasync) != 1){
+    printf("%s: fdatasync did not commit\n", s);
+    exit(1);
+  }
+  if(syncs(fd, fsync) != 1){
+    printf("%s: fsync did not commit\n", s);
+    exit(1);
+  }
+  n = getstat("log:", "synced");
+  if(fdatasync(fd) != 0 || getstat("log:", "synced") != n){
+    printf("%s: fdatasync of an unmodified file committed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("synctest");
+}
+
 void
 writebig(char *s)
 {
@@ -2589,6 +2652,7 @@ struct test {
   {iputtest, "iput"},
   {opentest, "opentest"},
   {writetest, "writetest"},
+  {synctest, "synctest"},
   {writebig, "writebig"},
   {createtest, "createtest"},
   {dirtest, "dirtest"},
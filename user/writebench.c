@@ -0,0 +1,77 @@
+//
+// Sequential write throughput: writes a file of the largest size
+// a file can have, then waits past the log's commit timer. Prints
+// the time taken, the throughput, and the log and block queue
+// counters; the block queue's bufs count every block written,
+// log and home locations both, so building with and without
+// JOURNALDATA=1 shows what writing file data in place saves.
+//
+// usage: writebench [file [chunk]]
+//
+// Without a file name it writes wbtmp, and removes it at the end,
+// since the file takes a large share of the disk.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+char buf[8192];
+
+int
+main(int argc, char *argv[])
+{
+  char *name;
+  int fd, n, chunk, total, t, keep;
+
+  name = "wbtmp";
+  keep = 0;
+  chunk = 4096;
+  if(argc > 1){
+    name = argv[1];
+    keep = 1;
+  }
+  if(argc > 2)
+    chunk = atoi(argv[2]);
+  if(chunk <= 0 || chunk > sizeof(buf)){
+    printf("writebench: chunk must be 1..%d\n", (int)sizeof(buf));
+    exit(1);
+  }
+
+  if((fd = open(name, O_CREATE | O_TRUNC | O_WRONLY)) < 0){
+    printf("writebench: cannot create %s\n", name);
+    exit(1);
+  }
+  printstats("log");
+  printstats("blkq");
+  memset(buf, 'w', sizeof(buf));
+  total = 0;
+  t = uptime();
+  while(total < MAXFILE*BSIZE){
+    n = MAXFILE*BSIZE - total;
+    if(n > chunk)
+      n = chunk;
+    if(write(fd, buf, n) != n){
+      printf("writebench: write error\n");
+      if(!keep)
+        unlink(name);
+      exit(1);
+    }
+    total += n;
+  }
+  close(fd);
+  t = uptime() - t;
+  sleep(2);  // let the last transaction commit
+
+  printf("writebench: %d bytes in %d ticks", total, t);
+  if(t > 0)
+    printf(", %d KB/s", total / 1024 * 10 / t);
+  printf("\n");
+  printstats("log");
+  printstats("blkq");
+  if(!keep)
+    unlink(name);
+  exit(0);
+}